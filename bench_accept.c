@@ -0,0 +1,207 @@
+/*
+ * This file is part of libsimplenet.
+ *
+ * Copyright (C) 2010 Greg Leclercq <ggl@0x80.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 or version 3.0 only.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/* Connection churn benchmark.
+ * Client threads connect, send one byte, wait for the one byte answer and
+ * close with a reset (no TIME_WAIT), as fast as they can. The accept rate is
+ * measured for each accept batch size given on the command line; a batch of
+ * 1 accepts a single connection per listener wakeup.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "network_socket.h"
+#include "network_server.h"
+
+#define BENCH_PORT	12399
+
+struct bench {
+	struct server	*server;
+	struct socket_config_tcp conf;
+	int		err;
+	volatile int	ready;
+	volatile int	stop;
+	unsigned long	nr_connections;
+	unsigned long	nr_errors;
+};
+
+static
+int
+bench_do_request(void *prv,
+		struct simple_buffer *bufwrite,
+		struct simple_buffer *bufread,
+		int *done)
+{
+	simple_buffer_append(bufwrite, "!", 1);
+	simple_buffer_clear(bufread);
+	*done = 1;
+	return 0;
+}
+
+static
+int
+bench_postlisten(void *bench_)
+{
+	struct bench *bench = bench_;
+	bench->ready = 1;
+	return 0;
+}
+
+static
+void *
+bench_server(void *bench_)
+{
+	struct bench *bench = bench_;
+	bench->err = server_listen(bench->server, &bench->conf);
+	bench->ready = 1;
+	return NULL;
+}
+
+static
+void *
+bench_client(void *bench_)
+{
+	struct bench *bench = bench_;
+	const struct linger reset = {1, 0};
+	/* a connection dropped from a full backlog must not outlive the run */
+	const struct timeval timeout = {1, 0};
+	unsigned long nr = 0, nr_errors = 0;
+	char c;
+	while (!bench->stop) {
+		int fd = socket_tcp();
+		if (fd == -1) {
+			nr_errors++;
+			continue;
+		}
+		setsockopt(fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO,
+				&timeout, sizeof(timeout));
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO,
+				&timeout, sizeof(timeout));
+		if (socket_connect_tcp(fd, bench->conf.ip, bench->conf.port) ||
+				write(fd, "?", 1) != 1 || read(fd, &c, 1) != 1)
+			nr_errors++;
+		else
+			nr++;
+		socket_close(fd);
+	}
+	__atomic_add_fetch(&bench->nr_connections, nr, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&bench->nr_errors, nr_errors, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+static
+int
+bench_run(uint32_t batch, int nr_clients, int seconds, int backlog)
+{
+	struct bench bench = {
+		.conf = {"127.0.0.1", BENCH_PORT, backlog},
+	};
+	struct server_callbacks callbacks = {
+		.do_request = bench_do_request,
+		.postlisten = bench_postlisten
+	};
+	pthread_t server_thread, clients[nr_clients];
+	struct timespec start, end;
+	int i, err;
+
+	bench.server = server_new(SOCKET_TCP, nr_clients * 2);
+	if (bench.server == NULL)
+		return errno;
+	err = server_init(bench.server, &callbacks, &bench, SERVER_NONBLOCKING);
+	if (err) goto out;
+	err = server_set_accept_batch(bench.server, batch);
+	if (err) goto out;
+	err = pthread_create(&server_thread, NULL, bench_server, &bench);
+	if (err) goto out;
+	while (!bench.ready)
+		usleep(1000);
+	if (bench.err) {
+		pthread_join(server_thread, NULL);
+		err = bench.err;
+		goto out;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nr_clients; i++)
+		pthread_create(&clients[i], NULL, bench_client, &bench);
+	sleep(seconds);
+	bench.stop = 1;
+	for (i = 0; i < nr_clients; i++)
+		pthread_join(clients[i], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	server_stop(bench.server, 0);
+	pthread_join(server_thread, NULL);
+	err = bench.err;
+
+	double elapsed = end.tv_sec - start.tv_sec +
+		(end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("batch %4u: %9.0f connections/s (%lu errors)\n", batch,
+		bench.nr_connections / elapsed, bench.nr_errors);
+out:
+	server_free(bench.server);
+	return err;
+}
+
+static
+void
+usage(char **argv)
+{
+	fprintf(stderr, "%s [-c clients] [-t seconds] [-b backlog] "
+			"[batch...]\n", argv[0]);
+}
+
+int
+main(int argc, char **argv)
+{
+	int nr_clients = 32, seconds = 3, backlog = 128;
+	int opt, err = 0;
+
+	while ((opt = getopt(argc, argv, "c:t:b:h")) != -1) {
+		switch (opt) {
+		case 'c': nr_clients = atoi(optarg); break;
+		case 't': seconds = atoi(optarg); break;
+		case 'b': backlog = atoi(optarg); break;
+		default:
+			usage(argv);
+			exit(EINVAL);
+		}
+	}
+	printf("%d clients, %d s per run, backlog %d\n",
+		nr_clients, seconds, backlog);
+	if (optind == argc) {
+		err = bench_run(1, nr_clients, seconds, backlog);
+		if (err == 0)
+			err = bench_run(SERVER_ACCEPT_BATCH, nr_clients,
+					seconds, backlog);
+	}
+	for (; optind < argc && err == 0; optind++)
+		err = bench_run(atoi(argv[optind]), nr_clients,
+				seconds, backlog);
+	if (err)
+		fprintf(stderr, "error: %s\n", strerror(err));
+	return err;
+}
+
+/* vim: ts=8:sw=8:noet
+*/
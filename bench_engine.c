@@ -0,0 +1,359 @@
+/*
+ * This file is part of libsimplenet.
+ *
+ * Copyright (C) 2010 Greg Leclercq <ggl@0x80.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 or version 3.0 only.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/* I/O engine benchmark on loopback.
+ * The same server runs with each engine of server_set_engine() in turn.
+ * Every client sends a batch of pipelined line requests, waits for all of
+ * their responses and starts over. The requests per second, the round trip
+ * percentiles of the batches and the CPU time of the process per request
+ * are reported for each engine. Large responses fill the socket buffers, so
+ * that connections wait for their socket to take more bytes. An engine that
+ * a loop cannot start is reported as such rather than measured.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+#include "network_socket.h"
+#include "network_server.h"
+
+#define BENCH_PORT	12396
+
+struct bench {
+	struct server	*server;
+	struct socket_config_tcp conf;
+	int		err;
+	volatile int	ready;
+	volatile int	stop;
+	uint32_t	nr_fallbacks; /* loops running libev instead */
+	char		*response;
+	size_t		response_size;
+	int		depth; /* requests of a batch */
+	unsigned long	nr_requests;
+	pthread_mutex_t	lock;
+	uint64_t	*samples; /* batch round trips, in ns */
+	size_t		nr_samples;
+	size_t		max_samples;
+};
+
+static
+int
+bench_do_request(void *bench_,
+		struct simple_buffer *bufwrite,
+		struct simple_buffer *bufread,
+		int *done)
+{
+	struct bench *bench = bench_;
+	const char *eol = simple_buffer_find_byte(bufread, '\n');
+	if (eol == NULL)
+		return EAGAIN;
+	simple_buffer_append(bufwrite, bench->response, bench->response_size);
+	simple_buffer_pull(bufread, eol - simple_buffer_get_head(bufread) + 1);
+	*done = 1;
+	return 0;
+}
+
+static
+int
+bench_postlisten(void *bench_)
+{
+	struct bench *bench = bench_;
+	struct server *server = bench->server;
+	uint32_t i;
+	for (i = 0; i < server->nr_loops; i++)
+		if (server_loop_engine(&server->loops[i]) != server->engine)
+			bench->nr_fallbacks++;
+	bench->ready = 1;
+	return 0;
+}
+
+static
+void *
+bench_server(void *bench_)
+{
+	struct bench *bench = bench_;
+	bench->err = server_listen(bench->server, &bench->conf);
+	bench->ready = 1;
+	return NULL;
+}
+
+static
+uint64_t
+bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static
+double
+bench_cpu(void)
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+		(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+static
+int
+bench_connect(struct bench *bench)
+{
+	int fd = socket_tcp();
+	if (fd == -1)
+		return -1;
+	if (socket_connect_tcp(fd, bench->conf.ip, bench->conf.port)) {
+		socket_close(fd);
+		return -1;
+	}
+	socket_set_tcpnodelay(fd);
+	return fd;
+}
+
+static
+void *
+bench_client(void *bench_)
+{
+	struct bench *bench = bench_;
+	size_t nr = 0, max = 1024;
+	unsigned long nr_requests = 0;
+	uint64_t *samples = malloc(max * sizeof(*samples));
+	size_t len = 2 * bench->depth;
+	char *requests = malloc(len), buf[64*1024];
+	int i, fd = bench_connect(bench);
+	if (fd == -1 || samples == NULL || requests == NULL)
+		goto out;
+	for (i = 0; i < bench->depth; i++)
+		memcpy(requests + 2 * i, "?\n", 2);
+	while (!bench->stop) {
+		size_t left = bench->depth * bench->response_size;
+		uint64_t start = bench_now();
+		if (write(fd, requests, len) != (ssize_t) len)
+			break;
+		while (left) {
+			ssize_t n = read(fd, buf,
+				left < sizeof(buf) ? left : sizeof(buf));
+			if (n <= 0)
+				goto done;
+			left -= n;
+		}
+		if (nr == max) {
+			uint64_t *more = realloc(samples,
+					2 * max * sizeof(*samples));
+			if (more == NULL)
+				break;
+			samples = more;
+			max *= 2;
+		}
+		samples[nr++] = bench_now() - start;
+		nr_requests += bench->depth;
+	}
+done:
+	pthread_mutex_lock(&bench->lock);
+	bench->nr_requests += nr_requests;
+	if (bench->nr_samples + nr > bench->max_samples) {
+		size_t total = bench->nr_samples + nr;
+		uint64_t *all = realloc(bench->samples,
+				total * sizeof(*all));
+		if (all) {
+			bench->samples = all;
+			bench->max_samples = total;
+		}
+	}
+	if (bench->nr_samples + nr <= bench->max_samples) {
+		memcpy(bench->samples + bench->nr_samples, samples,
+				nr * sizeof(*samples));
+		bench->nr_samples += nr;
+	}
+	pthread_mutex_unlock(&bench->lock);
+out:
+	if (fd != -1)
+		socket_close(fd);
+	free(requests);
+	free(samples);
+	return NULL;
+}
+
+static
+int
+bench_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+static
+double
+bench_percentile(struct bench *bench, double p)
+{
+	size_t i = p * (bench->nr_samples - 1);
+	return bench->samples[i] / 1000.0;
+}
+
+static
+int
+bench_run(server_engine_t engine, const char *name, int nr_clients,
+		int depth, size_t response_size, uint32_t nr_loops,
+		int seconds)
+{
+	struct bench bench = {
+		.conf = {"127.0.0.1", BENCH_PORT, 128},
+		.response_size = response_size,
+		.depth = depth,
+	};
+	struct server_callbacks callbacks = {
+		.do_request = bench_do_request,
+		.postlisten = bench_postlisten
+	};
+	pthread_t server_thread, clients[nr_clients];
+	double cpu;
+	int i, err;
+
+	pthread_mutex_init(&bench.lock, NULL);
+	bench.response = malloc(response_size);
+	bench.server = server_new(SOCKET_TCP, nr_clients);
+	if (bench.server == NULL || bench.response == NULL) {
+		err = errno;
+		goto out;
+	}
+	memset(bench.response, 'x', response_size);
+	bench.response[response_size - 1] = '\n';
+	err = server_init(bench.server, &callbacks, &bench,
+			SERVER_NONBLOCKING | SERVER_TCPNODELAY);
+	if (err) goto out;
+	err = server_set_loops(bench.server, nr_loops);
+	if (err) goto out;
+	err = server_set_engine(bench.server, engine);
+	if (err == ENOSYS) {
+		printf("%-8s not built in\n", name);
+		err = 0;
+		goto out;
+	}
+	if (err) goto out;
+	err = pthread_create(&server_thread, NULL, bench_server, &bench);
+	if (err) goto out;
+	while (!bench.ready)
+		usleep(1000);
+	if (bench.err) {
+		pthread_join(server_thread, NULL);
+		err = bench.err;
+		goto out;
+	}
+	/* its numbers would be those of libev */
+	if (bench.nr_fallbacks) {
+		server_stop(bench.server, 0);
+		pthread_join(server_thread, NULL);
+		printf("%-8s fell back to libev on %u of %u loop(s)\n", name,
+			bench.nr_fallbacks, bench.server->nr_loops);
+		err = bench.err;
+		goto out;
+	}
+
+	cpu = bench_cpu();
+	for (i = 0; i < nr_clients; i++)
+		pthread_create(&clients[i], NULL, bench_client, &bench);
+	sleep(seconds);
+	bench.stop = 1;
+	for (i = 0; i < nr_clients; i++)
+		pthread_join(clients[i], NULL);
+	cpu = bench_cpu() - cpu;
+
+	server_stop(bench.server, 0);
+	pthread_join(server_thread, NULL);
+	err = bench.err;
+
+	printf("%-8s %9.0f req/s", name,
+		(double) bench.nr_requests / seconds);
+	if (bench.nr_samples) {
+		qsort(bench.samples, bench.nr_samples, sizeof(*bench.samples),
+				bench_cmp);
+		printf(", batch p50 %.0f us, p99 %.0f us",
+			bench_percentile(&bench, 0.5),
+			bench_percentile(&bench, 0.99));
+	}
+	if (bench.nr_requests)
+		printf(", %.2f us CPU/req", cpu * 1e6 / bench.nr_requests);
+	printf("\n");
+out:
+	server_free(bench.server);
+	free(bench.response);
+	free(bench.samples);
+	pthread_mutex_destroy(&bench.lock);
+	return err;
+}
+
+static
+void
+usage(char **argv)
+{
+	fprintf(stderr, "%s [-c clients] [-d requests per batch] "
+			"[-s response size] [-l loops] [-t seconds]\n",
+			argv[0]);
+}
+
+int
+main(int argc, char **argv)
+{
+	static const struct {
+		server_engine_t engine;
+		const char *name;
+	} engines[] = {
+		{SERVER_ENGINE_LIBEV, "libev"},
+		{SERVER_ENGINE_EPOLL, "epoll"},
+		{SERVER_ENGINE_URING, "io_uring"}
+	};
+	int nr_clients = 32, depth = 16, seconds = 3;
+	size_t response_size = 64;
+	uint32_t nr_loops = 1;
+	unsigned int i;
+	int opt, err = 0;
+
+	while ((opt = getopt(argc, argv, "c:d:s:l:t:h")) != -1) {
+		switch (opt) {
+		case 'c': nr_clients = atoi(optarg); break;
+		case 'd': depth = atoi(optarg); break;
+		case 's': response_size = strtoul(optarg, NULL, 0); break;
+		case 'l': nr_loops = atoi(optarg); break;
+		case 't': seconds = atoi(optarg); break;
+		default:
+			usage(argv);
+			exit(EINVAL);
+		}
+	}
+	if (nr_clients <= 0 || depth <= 0 || response_size == 0) {
+		usage(argv);
+		exit(EINVAL);
+	}
+	printf("%d clients, %d requests per batch, %zu bytes responses, "
+		"%u loop(s), %d s per engine\n", nr_clients, depth,
+		response_size, nr_loops, seconds);
+	for (i = 0; i < sizeof(engines) / sizeof(engines[0]) && !err; i++)
+		err = bench_run(engines[i].engine, engines[i].name, nr_clients,
+				depth, response_size, nr_loops, seconds);
+	if (err)
+		fprintf(stderr, "error: %s\n", strerror(err));
+	return err;
+}
+
+/* vim: ts=8:sw=8:noet
+*/
@@ -0,0 +1,236 @@
+/*
+ * This file is part of libsimplenet.
+ *
+ * Copyright (C) 2010 Greg Leclercq <ggl@0x80.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 or version 3.0 only.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/* Idle connection footprint benchmark.
+ * Opens many connections that never send anything and reports how much the
+ * resident memory of the process grew per connection once the server
+ * accepted them all. The client sockets live in the same process but only
+ * cost kernel memory, so the growth is the server side state: the
+ * connection itself, its slot in the connection table and the event loop
+ * bookkeeping.
+ * Each connection needs two file descriptors: the limit is raised as far as
+ * the hard limit allows and the number of connections lowered to fit.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <arpa/inet.h>
+
+#include "network_socket.h"
+#include "network_server.h"
+
+#define BENCH_PORT	12398
+
+/* Connections per source address, below the ephemeral port range. */
+#define BENCH_PER_ADDR	25000
+
+struct bench {
+	struct server	*server;
+	struct socket_config_tcp conf;
+	int		err;
+	volatile int	ready;
+};
+
+static
+int
+bench_do_request(void *prv,
+		struct simple_buffer *bufwrite,
+		struct simple_buffer *bufread,
+		int *done)
+{
+	simple_buffer_clear(bufread);
+	*done = 1;
+	return 0;
+}
+
+static
+int
+bench_postlisten(void *bench_)
+{
+	struct bench *bench = bench_;
+	bench->ready = 1;
+	return 0;
+}
+
+static
+void *
+bench_server(void *bench_)
+{
+	struct bench *bench = bench_;
+	bench->err = server_listen(bench->server, &bench->conf);
+	bench->ready = 1;
+	return NULL;
+}
+
+static
+long
+bench_rss(void)
+{
+	long size, resident = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+	if (f == NULL)
+		return 0;
+	if (fscanf(f, "%ld %ld", &size, &resident) != 2)
+		resident = 0;
+	fclose(f);
+	return resident * getpagesize();
+}
+
+/** Connect from 127.0.0.2, 127.0.0.3... so that more connections than
+ * ephemeral ports can reach the same listener.
+ */
+static
+int
+bench_connect(struct bench *bench, int i)
+{
+	struct sockaddr_in src = {
+		.sin_family = AF_INET,
+		.sin_addr.s_addr =
+			htonl(INADDR_LOOPBACK + 1 + i / BENCH_PER_ADDR)
+	};
+	int fd = socket_tcp();
+	if (fd == -1)
+		return -1;
+	if (bind(fd, (struct sockaddr *) &src, sizeof(src)) ||
+			socket_connect_tcp(fd, bench->conf.ip,
+				bench->conf.port)) {
+		socket_close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static
+uint32_t
+bench_nr_clients(struct bench *bench)
+{
+	return __atomic_load_n(&bench->server->nr_clients, __ATOMIC_RELAXED);
+}
+
+static
+void
+usage(char **argv)
+{
+	fprintf(stderr, "%s [-n connections] [-l loops]\n", argv[0]);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct bench bench = {
+		.conf = {"127.0.0.1", BENCH_PORT, 4096},
+	};
+	struct server_callbacks callbacks = {
+		.do_request = bench_do_request,
+		.postlisten = bench_postlisten
+	};
+	int nr_connections = 100000, nr_loops = 1;
+	pthread_t server_thread;
+	struct rlimit limit;
+	int opt, i, err, *fds;
+
+	while ((opt = getopt(argc, argv, "n:l:h")) != -1) {
+		switch (opt) {
+		case 'n': nr_connections = atoi(optarg); break;
+		case 'l': nr_loops = atoi(optarg); break;
+		default:
+			usage(argv);
+			exit(EINVAL);
+		}
+	}
+	getrlimit(RLIMIT_NOFILE, &limit);
+	limit.rlim_cur = limit.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &limit);
+	if ((rlim_t) nr_connections * 2 + 64 > limit.rlim_cur) {
+		nr_connections = (limit.rlim_cur - 64) / 2;
+		fprintf(stderr, "file descriptor limit %lu: %d connections\n",
+			(unsigned long) limit.rlim_cur, nr_connections);
+	}
+	fds = malloc(nr_connections * sizeof(*fds));
+	if (fds == NULL)
+		return ENOMEM;
+
+	bench.server = server_new(SOCKET_TCP, nr_connections);
+	if (bench.server == NULL)
+		return errno;
+	err = server_init(bench.server, &callbacks, &bench, SERVER_NONBLOCKING);
+	if (err == 0)
+		err = server_set_loops(bench.server, nr_loops);
+	if (err == 0)
+		err = pthread_create(&server_thread, NULL, bench_server,
+				&bench);
+	if (err) goto out;
+	while (!bench.ready)
+		usleep(1000);
+	if (bench.err) {
+		pthread_join(server_thread, NULL);
+		err = bench.err;
+		goto out;
+	}
+
+	long rss_before = bench_rss();
+	for (i = 0; i < nr_connections; i++) {
+		/* do not overflow the listen backlog */
+		while (i - (int) bench_nr_clients(&bench) >
+				bench.conf.backlog / 2)
+			usleep(100);
+		fds[i] = bench_connect(&bench, i);
+		if (fds[i] == -1) {
+			err = errno;
+			fprintf(stderr, "connection %d: %s\n", i,
+				strerror(err));
+			break;
+		}
+	}
+	nr_connections = i;
+	while (bench_nr_clients(&bench) < (uint32_t) nr_connections)
+		usleep(1000);
+	long rss_after = bench_rss();
+
+	printf("%d idle connections, %u loop(s)\n",
+		nr_connections, bench.server->nr_loops);
+	printf("sizeof(struct peer_client): %zu bytes, %u per slab\n",
+		sizeof(struct peer_client),
+		bench.server->loops[0].client_slab.nr_objects);
+	if (nr_connections)
+		printf("resident memory: %ld KB, %ld bytes per connection\n",
+			(rss_after - rss_before) / 1024,
+			(rss_after - rss_before) / nr_connections);
+
+	/* reset, no TIME_WAIT to hold the ports of the next run */
+	for (i = 0; i < nr_connections; i++) {
+		const struct linger reset = {1, 0};
+		setsockopt(fds[i], SOL_SOCKET, SO_LINGER,
+				&reset, sizeof(reset));
+		socket_close(fds[i]);
+	}
+	server_stop(bench.server, 0);
+	pthread_join(server_thread, NULL);
+out:
+	server_free(bench.server);
+	free(fds);
+	if (err)
+		fprintf(stderr, "error: %s\n", strerror(err));
+	return err;
+}
+
+/* vim: ts=8:sw=8:noet
+*/
@@ -0,0 +1,331 @@
+/*
+ * This file is part of libsimplenet.
+ *
+ * Copyright (C) 2010 Greg Leclercq <ggl@0x80.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 or version 3.0 only.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/* Latency benchmark with one heavy and many light clients.
+ * A single loop serves line-based requests, answered with one byte each.
+ * The heavy client streams pipelined requests as fast as the server takes
+ * them while the light clients send one request at a time and measure the
+ * time until its answer. The round trip percentiles of the light clients
+ * are reported without read budget, then with the given budget.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "network_socket.h"
+#include "network_server.h"
+
+#define BENCH_PORT	12397
+
+/* Size of the heavy client requests, newline included. */
+#define BENCH_LINE	64
+
+struct bench {
+	struct server	*server;
+	struct socket_config_tcp conf;
+	int		err;
+	volatile int	ready;
+	volatile int	stop;
+	unsigned long	heavy_bytes;
+	pthread_mutex_t	lock;
+	uint64_t	*samples; /* light client round trips, in ns */
+	size_t		nr_samples;
+	size_t		max_samples;
+};
+
+static
+int
+bench_do_request(void *prv,
+		struct simple_buffer *bufwrite,
+		struct simple_buffer *bufread,
+		int *done)
+{
+	const char *eol = simple_buffer_find_byte(bufread, '\n');
+	if (eol == NULL)
+		return EAGAIN;
+	simple_buffer_append(bufwrite, "!", 1);
+	simple_buffer_pull(bufread, eol - simple_buffer_get_head(bufread) + 1);
+	*done = 1;
+	return 0;
+}
+
+static
+int
+bench_postlisten(void *bench_)
+{
+	struct bench *bench = bench_;
+	bench->ready = 1;
+	return 0;
+}
+
+static
+void *
+bench_server(void *bench_)
+{
+	struct bench *bench = bench_;
+	bench->err = server_listen(bench->server, &bench->conf);
+	bench->ready = 1;
+	return NULL;
+}
+
+static
+uint64_t
+bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static
+int
+bench_connect(struct bench *bench)
+{
+	int fd = socket_tcp();
+	if (fd == -1)
+		return -1;
+	if (socket_connect_tcp(fd, bench->conf.ip, bench->conf.port)) {
+		socket_close(fd);
+		return -1;
+	}
+	socket_set_tcpnodelay(fd);
+	return fd;
+}
+
+/* Read the answers of the heavy client so that it is never throttled. */
+static
+void *
+bench_heavy_reader(void *fd_)
+{
+	int fd = (int) (intptr_t) fd_;
+	char buf[64*1024];
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+	return NULL;
+}
+
+static
+void *
+bench_heavy(void *bench_)
+{
+	struct bench *bench = bench_;
+	char buf[1024 * BENCH_LINE];
+	unsigned long sent = 0;
+	pthread_t reader;
+	size_t i;
+	int fd = bench_connect(bench);
+	if (fd == -1)
+		return NULL;
+	memset(buf, 'x', sizeof(buf));
+	for (i = BENCH_LINE - 1; i < sizeof(buf); i += BENCH_LINE)
+		buf[i] = '\n';
+	pthread_create(&reader, NULL, bench_heavy_reader,
+			(void *) (intptr_t) fd);
+	while (!bench->stop) {
+		ssize_t n = write(fd, buf, sizeof(buf));
+		if (n <= 0)
+			break;
+		sent += n;
+	}
+	shutdown(fd, SHUT_RDWR);
+	pthread_join(reader, NULL);
+	socket_close(fd);
+	bench->heavy_bytes = sent;
+	return NULL;
+}
+
+static
+void *
+bench_light(void *bench_)
+{
+	struct bench *bench = bench_;
+	size_t nr = 0, max = 1024;
+	uint64_t *samples = malloc(max * sizeof(*samples));
+	char c;
+	int fd = bench_connect(bench);
+	if (fd == -1 || samples == NULL)
+		goto out;
+	while (!bench->stop) {
+		uint64_t start = bench_now();
+		if (write(fd, "?\n", 2) != 2 || read(fd, &c, 1) != 1)
+			break;
+		if (nr == max) {
+			uint64_t *more = realloc(samples,
+					2 * max * sizeof(*samples));
+			if (more == NULL)
+				break;
+			samples = more;
+			max *= 2;
+		}
+		samples[nr++] = bench_now() - start;
+	}
+	pthread_mutex_lock(&bench->lock);
+	if (bench->nr_samples + nr > bench->max_samples) {
+		size_t total = bench->nr_samples + nr;
+		uint64_t *all = realloc(bench->samples,
+				total * sizeof(*all));
+		if (all) {
+			bench->samples = all;
+			bench->max_samples = total;
+		}
+	}
+	if (bench->nr_samples + nr <= bench->max_samples) {
+		memcpy(bench->samples + bench->nr_samples, samples,
+				nr * sizeof(*samples));
+		bench->nr_samples += nr;
+	}
+	pthread_mutex_unlock(&bench->lock);
+out:
+	if (fd != -1)
+		socket_close(fd);
+	free(samples);
+	return NULL;
+}
+
+static
+int
+bench_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+static
+double
+bench_percentile(struct bench *bench, double p)
+{
+	size_t i = p * (bench->nr_samples - 1);
+	return bench->samples[i] / 1000.0;
+}
+
+static
+int
+bench_run(size_t budget_bytes, uint32_t budget_requests, int nr_light,
+		int seconds)
+{
+	struct bench bench = {
+		.conf = {"127.0.0.1", BENCH_PORT, 128},
+	};
+	struct server_callbacks callbacks = {
+		.do_request = bench_do_request,
+		.postlisten = bench_postlisten
+	};
+	pthread_t server_thread, heavy, light[nr_light];
+	int i, err;
+
+	pthread_mutex_init(&bench.lock, NULL);
+	bench.server = server_new(SOCKET_TCP, nr_light + 1);
+	if (bench.server == NULL)
+		return errno;
+	err = server_init(bench.server, &callbacks, &bench,
+			SERVER_NONBLOCKING | SERVER_TCPNODELAY);
+	if (err) goto out;
+	err = server_set_read_budget(bench.server, budget_bytes,
+			budget_requests);
+	if (err) goto out;
+	err = pthread_create(&server_thread, NULL, bench_server, &bench);
+	if (err) goto out;
+	while (!bench.ready)
+		usleep(1000);
+	if (bench.err) {
+		pthread_join(server_thread, NULL);
+		err = bench.err;
+		goto out;
+	}
+
+	pthread_create(&heavy, NULL, bench_heavy, &bench);
+	/* let the heavy client fill its socket buffers first */
+	usleep(100000);
+	for (i = 0; i < nr_light; i++)
+		pthread_create(&light[i], NULL, bench_light, &bench);
+	sleep(seconds);
+	bench.stop = 1;
+	for (i = 0; i < nr_light; i++)
+		pthread_join(light[i], NULL);
+	pthread_join(heavy, NULL);
+
+	server_stop(bench.server, 0);
+	pthread_join(server_thread, NULL);
+	err = bench.err;
+
+	if (budget_bytes || budget_requests)
+		printf("budget %zu bytes, %u requests:\n",
+			budget_bytes, budget_requests);
+	else
+		printf("no budget:\n");
+	if (bench.nr_samples) {
+		qsort(bench.samples, bench.nr_samples, sizeof(*bench.samples),
+				bench_cmp);
+		printf("  light: %zu requests, p50 %.0f us, p99 %.0f us, "
+			"p99.9 %.0f us, max %.0f us\n", bench.nr_samples,
+			bench_percentile(&bench, 0.5),
+			bench_percentile(&bench, 0.99),
+			bench_percentile(&bench, 0.999),
+			bench_percentile(&bench, 1));
+	}
+	printf("  heavy: %.1f MB/s\n", bench.heavy_bytes / 1e6 / seconds);
+out:
+	server_free(bench.server);
+	free(bench.samples);
+	pthread_mutex_destroy(&bench.lock);
+	return err;
+}
+
+static
+void
+usage(char **argv)
+{
+	fprintf(stderr, "%s [-c light clients] [-t seconds] [-b budget bytes] "
+			"[-r budget requests]\n", argv[0]);
+}
+
+int
+main(int argc, char **argv)
+{
+	int nr_light = 16, seconds = 3;
+	size_t budget_bytes = 64*1024;
+	uint32_t budget_requests = 0;
+	int opt, err;
+
+	while ((opt = getopt(argc, argv, "c:t:b:r:h")) != -1) {
+		switch (opt) {
+		case 'c': nr_light = atoi(optarg); break;
+		case 't': seconds = atoi(optarg); break;
+		case 'b': budget_bytes = strtoul(optarg, NULL, 0); break;
+		case 'r': budget_requests = strtoul(optarg, NULL, 0); break;
+		default:
+			usage(argv);
+			exit(EINVAL);
+		}
+	}
+	printf("1 heavy client, %d light clients, %d s per run\n",
+		nr_light, seconds);
+	err = bench_run(0, 0, nr_light, seconds);
+	if (err == 0)
+		err = bench_run(budget_bytes, budget_requests, nr_light,
+				seconds);
+	if (err)
+		fprintf(stderr, "error: %s\n", strerror(err));
+	return err;
+}
+
+/* vim: ts=8:sw=8:noet
+*/
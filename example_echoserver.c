@@ -23,7 +23,7 @@
 
 
 /** Simple echo callback.
- *
+ * The response is encoded in place at the tail of bufwrite.
  */
 int
 client_callback_do_request(void *data,
@@ -31,10 +31,14 @@ client_callback_do_request(void *data,
 		struct simple_buffer *bufread,
 		int *done)
 {
-	simple_buffer_append(bufwrite, (char *) data, strlen(data));
-	simple_buffer_append(bufwrite,
-			simple_buffer_get_head(bufread),
-			simple_buffer_size(bufread));
+	const size_t prefix_len = strlen(data);
+	const size_t len = simple_buffer_size(bufread);
+	char *out = simple_buffer_reserve(bufwrite, prefix_len + len);
+	if (out == NULL)
+		return errno;
+	memcpy(out, data, prefix_len);
+	memcpy(out + prefix_len, simple_buffer_get_head(bufread), len);
+	simple_buffer_commit(bufwrite, prefix_len + len);
 	simple_buffer_clear(bufread);
 	*done = 1;
 	return 0;
@@ -90,10 +94,10 @@ main(int argc, char **argv)
 	};
 	int err = server_init(server, &callbacks, "hello, ", SERVER_NONBLOCKING);
 	if (err) goto fail_server_init;
-	server_listen(server, conf);
+	err = server_listen(server, conf);
 
 fail_server_init:
-	server_stop(server, err);
+	server_free(server);
 	exit(err);
 }
 
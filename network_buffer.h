@@ -18,11 +18,17 @@
 
 #include <sys/types.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <assert.h>
 #include <errno.h>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# include <immintrin.h>
+# define SIMPLE_BUFFER_X86_SIMD 1
+#endif
+
 /*
  * data    tail
  * v        v
@@ -30,7 +36,50 @@
  * |--|XX|XX|00|00|
  *    ^           ^
  *   head        end
+ *
+ * In SIMPLE_BUFFER_COMPACT mode, the consumed prefix (between data and head)
+ * is reused: when the tail runs out of room, the pending bytes are moved back
+ * to data instead of growing the buffer, as long as it moves no more bytes
+ * than it reclaims. A buffer that is fully consumed is rewound for free.
+ */
+#define SIMPLE_BUFFER_COMPACT	0x1
+
+/*
+ * A SIMPLE_BUFFER_VIEW buffer reads bytes it does not own, see
+ * simple_buffer_init_view(): it is never reallocated, so it cannot grow.
  */
+#define SIMPLE_BUFFER_VIEW	0x2
+
+/* Default growth: double the capacity, without cap. */
+#define SIMPLE_BUFFER_GROWTH_FACTOR	200
+#define SIMPLE_BUFFER_GROWTH_CAP	0
+
+/*
+ * growth_factor: percentage of the current capacity to grow to when the tail
+ *                runs out of room (100 grows linearly to the needed size).
+ * growth_cap:    maximum number of bytes added by a single growth, 0 means
+ *                no cap. The needed size always wins over the cap.
+ * retain_size:   capacity that simple_buffer_clear() never gives back.
+ *
+ * Above retain_size, simple_buffer_clear() keeps a decaying high watermark of
+ * the recently used capacity, fed by the furthest tail reached since the
+ * previous clear (`peak`, taken before pull, compact or rewind moves tail
+ * back), and only shrinks once the buffer is more than
+ * twice as large as that watermark, so traffic alternating between small and
+ * large messages does not realloc() on every message.
+ */
+struct simple_buffer_policy {
+	uint32_t growth_factor;
+	uint32_t growth_cap;
+	uint32_t retain_size;
+};
+
+struct simple_buffer_stats {
+	uint32_t nr_grow;	/* realloc() to a larger size */
+	uint32_t nr_shrink;	/* realloc() to a smaller size */
+	uint32_t nr_compact;	/* memmove() of pending bytes to data */
+};
+
 struct simple_buffer {
         char    *data;
         char    *head;
@@ -39,6 +88,12 @@ struct simple_buffer {
         uint32_t size;
         uint32_t max_size;
         uint32_t chunk_size;
+	uint32_t flags;
+	uint32_t need;
+	uint32_t watermark;
+	uint32_t peak;
+	struct simple_buffer_policy policy;
+	struct simple_buffer_stats stats;
 };
 
 
@@ -57,6 +112,14 @@ simple_buffer_new(uint32_t chunk_size)
 	buf->tail = buf->head;
 	buf->userptr = buf->head;
 	buf->size = 0;
+	buf->flags = 0;
+	buf->need = 0;
+	buf->watermark = 0;
+	buf->peak = 0;
+	buf->policy.growth_factor = SIMPLE_BUFFER_GROWTH_FACTOR;
+	buf->policy.growth_cap = SIMPLE_BUFFER_GROWTH_CAP;
+	buf->policy.retain_size = chunk_size;
+	memset(&buf->stats, 0, sizeof(buf->stats));
 
 	return buf;
 fail_data:
@@ -74,6 +137,53 @@ simple_buffer_free(struct simple_buffer *buf)
 	free(buf);
 }
 
+/** Make `buf` a view of the `len` bytes at `data`, to parse them in place.
+ * The view does not own them: they must outlive it, it cannot grow and
+ * must not be freed with simple_buffer_free().
+ */
+static inline
+void
+simple_buffer_init_view(struct simple_buffer *buf, char *data, uint32_t len)
+{
+	buf->chunk_size = len ? len : 1;
+	buf->max_size = len;
+	buf->data = data;
+	buf->head = buf->data;
+	buf->tail = buf->head + len;
+	buf->userptr = buf->head;
+	buf->size = len;
+	buf->flags = SIMPLE_BUFFER_VIEW;
+	buf->need = 0;
+	buf->watermark = 0;
+	buf->peak = 0;
+	buf->policy.growth_factor = SIMPLE_BUFFER_GROWTH_FACTOR;
+	buf->policy.growth_cap = SIMPLE_BUFFER_GROWTH_CAP;
+	buf->policy.retain_size = len;
+	memset(&buf->stats, 0, sizeof(buf->stats));
+}
+
+static inline
+void
+simple_buffer_set_flags(struct simple_buffer *buf, uint32_t flags)
+{
+	buf->flags = flags;
+}
+
+static inline
+void
+simple_buffer_set_policy(struct simple_buffer *buf,
+		const struct simple_buffer_policy *policy)
+{
+	buf->policy = *policy;
+}
+
+static inline
+const struct simple_buffer_stats *
+simple_buffer_get_stats(struct simple_buffer *buf)
+{
+	return &buf->stats;
+}
+
 static inline
 unsigned int
 simple_buffer_size(struct simple_buffer *buf)
@@ -81,6 +191,27 @@ simple_buffer_size(struct simple_buffer *buf)
 	return buf->size; 
 }
 
+/** Tell the reader how many bytes (counted from head) must be buffered
+ * before the consumer can make progress.
+ * A request handler that returns EAGAIN on an incomplete message can set it
+ * so that it is not called again until that many bytes are available. The
+ * hint shrinks as bytes are pulled and is reset by simple_buffer_rewind().
+ */
+static inline
+void
+simple_buffer_set_need(struct simple_buffer *buf, uint32_t len)
+{
+	buf->need = len;
+}
+
+/** Number of bytes still missing to satisfy simple_buffer_set_need(). */
+static inline
+unsigned int
+simple_buffer_missing(struct simple_buffer *buf)
+{
+	return buf->need > buf->size ? buf->need - buf->size : 0;
+}
+
 static inline
 unsigned int
 simple_buffer_size_from_userptr(struct simple_buffer *buf)
@@ -120,14 +251,24 @@ static inline
 int
 simple_buffer_resize(struct simple_buffer * const buf, size_t newsize)
 {
-	if (newsize != buf->max_size) {
+	size_t max_size = (newsize + buf->chunk_size - 1) / buf->chunk_size *
+		buf->chunk_size;
+	if (max_size == 0)
+		max_size = buf->chunk_size;
+	if (max_size != buf->max_size) {
+		if (buf->flags & SIMPLE_BUFFER_VIEW)
+			return ENOBUFS;
 		size_t head_offset = buf->head - buf->data;
 		size_t tail_offset = buf->tail - buf->data;
 		size_t userptr_offset = buf->userptr - buf->data;
-		buf->max_size = (newsize/buf->chunk_size+1) * buf->chunk_size;
-		char *newbufdata = realloc(buf->data, buf->max_size);
+		char *newbufdata = realloc(buf->data, max_size);
 		if (newbufdata == NULL)
 			return errno;
+		if (max_size > buf->max_size)
+			buf->stats.nr_grow++;
+		else
+			buf->stats.nr_shrink++;
+		buf->max_size = max_size;
 		buf->data = newbufdata;
 		buf->head = buf->data + head_offset;
 		buf->tail = buf->data + tail_offset;
@@ -150,6 +291,114 @@ simple_buffer_resize_tail(struct simple_buffer *buf, size_t newsize)
 	return 0;
 }
 
+/** Number of free bytes between tail and the end of the buffer.
+ * They can be filled in place, e.g. by read(2), then published with
+ * simple_buffer_move_tail().
+ */
+static inline
+unsigned int
+simple_buffer_tailroom(struct simple_buffer *buf)
+{
+	return buf->data + buf->max_size - buf->tail;
+}
+
+/* Remember how far tail went before it moves back to data. */
+static inline
+void
+simple_buffer_track_peak(struct simple_buffer *buf)
+{
+	uint32_t used = buf->tail - buf->data;
+	if (used > buf->peak)
+		buf->peak = used;
+}
+
+/** Move pending bytes (head to tail) back to the beginning of data.
+ * userptr keeps its offset from head.
+ */
+static inline
+void
+simple_buffer_compact(struct simple_buffer *buf)
+{
+	size_t userptr_offset = buf->userptr - buf->head;
+	if (buf->head == buf->data)
+		return ;
+	simple_buffer_track_peak(buf);
+	memmove(buf->data, buf->head, buf->size);
+	buf->stats.nr_compact++;
+	buf->head = buf->data;
+	buf->tail = buf->head + buf->size;
+	buf->userptr = buf->head + userptr_offset;
+}
+
+/** Make sure at least `len` bytes are free after tail.
+ * Unlike simple_buffer_resize_tail(), it never shrinks the buffer and only
+ * calls realloc() when the current tail room is too small.
+ * In SIMPLE_BUFFER_COMPACT mode, it compacts instead when that provides
+ * enough room and moves fewer bytes than it reclaims, so the cost of
+ * compacting stays amortized over the consumed bytes.
+ * Otherwise the buffer grows according to its policy.
+ * @return 0 on success, errno value on error.
+ */
+static inline
+int
+simple_buffer_ensure_tailroom(struct simple_buffer *buf, size_t len)
+{
+	if (simple_buffer_tailroom(buf) >= len)
+		return 0;
+	if (buf->flags & SIMPLE_BUFFER_COMPACT) {
+		size_t consumed = buf->head - buf->data;
+		if (consumed >= buf->size &&
+				consumed + simple_buffer_tailroom(buf) >= len) {
+			simple_buffer_compact(buf);
+			return 0;
+		}
+	}
+	size_t needed = buf->tail - buf->data + len;
+	size_t newsize = (size_t) buf->max_size *
+		buf->policy.growth_factor / 100;
+	if (buf->policy.growth_cap &&
+			newsize > buf->max_size + buf->policy.growth_cap)
+		newsize = buf->max_size + buf->policy.growth_cap;
+	if (newsize < needed)
+		newsize = needed;
+	return simple_buffer_resize(buf, newsize);
+}
+
+/** Reserve at least `len` writable bytes after tail.
+ * The bytes written there are not part of the buffer until they are
+ * published with simple_buffer_commit(), so a serializer can encode in place
+ * instead of building its output elsewhere and appending it.
+ * The returned pointer stays valid until the next call that may grow or
+ * compact the buffer. head, tail and userptr keep their offsets across such
+ * calls.
+ * @return pointer to the tail, NULL on error (errno is set).
+ */
+static inline
+char *
+simple_buffer_reserve(struct simple_buffer * const buf, size_t len)
+{
+	int err = simple_buffer_ensure_tailroom(buf, len);
+	if (err) {
+		errno = err;
+		return NULL;
+	}
+	return buf->tail;
+}
+
+/** Publish `len` bytes written after tail.
+ * `len` must not exceed the room reserved by simple_buffer_reserve().
+ * userptr is left untouched: the new bytes are still to be parsed.
+ */
+static inline
+int
+simple_buffer_commit(struct simple_buffer * const buf, size_t len)
+{
+	assert(len <= simple_buffer_tailroom(buf));
+	buf->tail += len;
+	buf->size += len;
+	return 0;
+}
+
 static inline
 int
 simple_buffer_append(struct simple_buffer * const buf,
@@ -157,10 +406,8 @@ simple_buffer_append(struct simple_buffer * const buf,
 		const size_t data_len)
 {
 	assert(buf != NULL);
-	if (buf->tail > buf->data + buf->max_size - data_len) {
-		int err = simple_buffer_resize(buf, buf->max_size+data_len);
-		if (err) return err;
-	}
+	int err = simple_buffer_ensure_tailroom(buf, data_len);
+	if (err) return err;
 	memcpy(buf->tail, (char *) data, data_len);
 	buf->tail += data_len;
 	buf->size += data_len;
@@ -168,6 +415,16 @@ simple_buffer_append(struct simple_buffer * const buf,
 	return 0;
 }
 
+/** Consume `len` bytes at the head of the buffer, at most its size.
+ * A userptr that falls behind the new head is moved to it, so that it
+ * always points to pending bytes or to tail. A userptr further ahead is
+ * left alone.
+ * The byte count requested with simple_buffer_set_need() shrinks by the
+ * consumed bytes.
+ * In SIMPLE_BUFFER_COMPACT mode, a buffer emptied by the pull is rewound:
+ * head, tail and userptr go back to the start.
+ * @return 0.
+ */
 static inline
 int
 simple_buffer_pull(struct simple_buffer * const buf, uint32_t len)
@@ -176,6 +433,15 @@ simple_buffer_pull(struct simple_buffer * const buf, uint32_t len)
 		len = buf->size;
 	buf->head += len;
 	buf->size -= len;
+	buf->need = buf->need > len ? buf->need - len : 0;
+	if (buf->userptr < buf->head)
+		buf->userptr = buf->head;
+	if (buf->size == 0 && (buf->flags & SIMPLE_BUFFER_COMPACT)) {
+		simple_buffer_track_peak(buf);
+		buf->head = buf->data;
+		buf->tail = buf->head;
+		buf->userptr = buf->head;
+	}
 	return 0;
 }
 
@@ -227,25 +493,337 @@ static inline
 int
 simple_buffer_rewind(struct simple_buffer * const buf)
 {
+	simple_buffer_track_peak(buf);
 	buf->head = buf->data;
 	buf->tail = buf->head;
 	buf->userptr = buf->head;
 	buf->size = 0;
+	buf->need = 0;
 	return 0;
 }
 
+/** Rewind the buffer and give back memory according to its policy.
+ * See struct simple_buffer_policy for the hysteresis.
+ * @return 0 on success, errno value on error.
+ */
 static inline
 int
 simple_buffer_clear(struct simple_buffer * const buf)
 {
-	if (buf->max_size > buf->chunk_size) {
-		buf->data = realloc(buf->data, buf->chunk_size);
-		if (buf->data == NULL) return errno;
-		buf->max_size = buf->chunk_size;
+	simple_buffer_rewind(buf);
+	buf->watermark -= buf->watermark / 4;
+	if (buf->peak > buf->watermark)
+		buf->watermark = buf->peak;
+	buf->peak = 0;
+	size_t keep = buf->watermark;
+	if (keep < buf->policy.retain_size)
+		keep = buf->policy.retain_size;
+	if (keep < buf->chunk_size)
+		keep = buf->chunk_size;
+	if (buf->max_size > 2 * keep)
+		return simple_buffer_resize(buf, keep);
+	return 0;
+}
+
+
+
+/* Delimiter search.
+ *
+ * The helpers below scan the bytes between userptr and tail, so that a
+ * protocol parser resuming after a partial read never rescans the bytes it
+ * already looked at. On a match, userptr points to the match. On a miss, it
+ * is moved to the first position where a match may still start once more
+ * bytes are appended. simple_buffer_pull() drags userptr along with head.
+ *
+ * The implementation (AVX2, SSE2 or scalar) is chosen at runtime, the first
+ * time a search is performed.
+ */
+
+typedef const char *(*simple_find_byte_t)(const char *p, const char *end,
+		char c);
+typedef const char *(*simple_find_pair_t)(const char *p, const char *end,
+		char c0, char c1);
+typedef const char *(*simple_find_any_t)(const char *p, const char *end,
+		const char *set, size_t setlen);
+
+struct simple_search_ops {
+	const char		*name;
+	simple_find_byte_t	find_byte;
+	simple_find_pair_t	find_pair;
+	simple_find_any_t	find_any;
+};
+
+/* Above this set size, the vector any-of-set search falls back to scalar. */
+#define SIMPLE_SEARCH_SET_MAX	8
+
+static inline
+const char *
+simple_find_byte_scalar(const char *p, const char *end, char c)
+{
+	return memchr(p, c, end - p);
+}
+
+static inline
+const char *
+simple_find_pair_scalar(const char *p, const char *end, char c0, char c1)
+{
+	while (end - p >= 2) {
+		p = memchr(p, c0, end - p - 1);
+		if (p == NULL)
+			return NULL;
+		if (p[1] == c1)
+			return p;
+		p++;
+	}
+	return NULL;
+}
+
+static inline
+const char *
+simple_find_any_scalar(const char *p, const char *end,
+		const char *set, size_t setlen)
+{
+	unsigned char table[256];
+	size_t i;
+	memset(table, 0, sizeof(table));
+	for (i = 0; i < setlen; i++)
+		table[(unsigned char) set[i]] = 1;
+	for (; p < end; p++)
+		if (table[(unsigned char) *p])
+			return p;
+	return NULL;
+}
+
+#ifdef SIMPLE_BUFFER_X86_SIMD
+
+__attribute__((target("sse2")))
+static inline
+const char *
+simple_find_byte_sse2(const char *p, const char *end, char c)
+{
+	const __m128i needle = _mm_set1_epi8(c);
+	while (end - p >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) p);
+		unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, needle));
+		if (mask)
+			return p + __builtin_ctz(mask);
+		p += 16;
+	}
+	return simple_find_byte_scalar(p, end, c);
+}
+
+__attribute__((target("sse2")))
+static inline
+const char *
+simple_find_pair_sse2(const char *p, const char *end, char c0, char c1)
+{
+	const __m128i n0 = _mm_set1_epi8(c0);
+	const __m128i n1 = _mm_set1_epi8(c1);
+	while (end - p >= 17) {
+		__m128i v0 = _mm_loadu_si128((const __m128i *) p);
+		__m128i v1 = _mm_loadu_si128((const __m128i *) (p + 1));
+		unsigned int mask = _mm_movemask_epi8(_mm_and_si128(
+					_mm_cmpeq_epi8(v0, n0),
+					_mm_cmpeq_epi8(v1, n1)));
+		if (mask)
+			return p + __builtin_ctz(mask);
+		p += 16;
+	}
+	return simple_find_pair_scalar(p, end, c0, c1);
+}
+
+__attribute__((target("sse2")))
+static inline
+const char *
+simple_find_any_sse2(const char *p, const char *end,
+		const char *set, size_t setlen)
+{
+	__m128i needles[SIMPLE_SEARCH_SET_MAX];
+	size_t i;
+	if (setlen > SIMPLE_SEARCH_SET_MAX)
+		return simple_find_any_scalar(p, end, set, setlen);
+	for (i = 0; i < setlen; i++)
+		needles[i] = _mm_set1_epi8(set[i]);
+	while (end - p >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) p);
+		__m128i m = _mm_setzero_si128();
+		for (i = 0; i < setlen; i++)
+			m = _mm_or_si128(m, _mm_cmpeq_epi8(v, needles[i]));
+		unsigned int mask = _mm_movemask_epi8(m);
+		if (mask)
+			return p + __builtin_ctz(mask);
+		p += 16;
+	}
+	return simple_find_any_scalar(p, end, set, setlen);
+}
+
+__attribute__((target("avx2")))
+static inline
+const char *
+simple_find_byte_avx2(const char *p, const char *end, char c)
+{
+	const __m256i needle = _mm256_set1_epi8(c);
+	while (end - p >= 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) p);
+		unsigned int mask = _mm256_movemask_epi8(
+				_mm256_cmpeq_epi8(v, needle));
+		if (mask)
+			return p + __builtin_ctz(mask);
+		p += 32;
 	}
-	return simple_buffer_rewind(buf);
+	return simple_find_byte_sse2(p, end, c);
 }
 
+__attribute__((target("avx2")))
+static inline
+const char *
+simple_find_pair_avx2(const char *p, const char *end, char c0, char c1)
+{
+	const __m256i n0 = _mm256_set1_epi8(c0);
+	const __m256i n1 = _mm256_set1_epi8(c1);
+	while (end - p >= 33) {
+		__m256i v0 = _mm256_loadu_si256((const __m256i *) p);
+		__m256i v1 = _mm256_loadu_si256((const __m256i *) (p + 1));
+		unsigned int mask = _mm256_movemask_epi8(_mm256_and_si256(
+					_mm256_cmpeq_epi8(v0, n0),
+					_mm256_cmpeq_epi8(v1, n1)));
+		if (mask)
+			return p + __builtin_ctz(mask);
+		p += 32;
+	}
+	return simple_find_pair_sse2(p, end, c0, c1);
+}
+
+__attribute__((target("avx2")))
+static inline
+const char *
+simple_find_any_avx2(const char *p, const char *end,
+		const char *set, size_t setlen)
+{
+	__m256i needles[SIMPLE_SEARCH_SET_MAX];
+	size_t i;
+	if (setlen > SIMPLE_SEARCH_SET_MAX)
+		return simple_find_any_scalar(p, end, set, setlen);
+	for (i = 0; i < setlen; i++)
+		needles[i] = _mm256_set1_epi8(set[i]);
+	while (end - p >= 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) p);
+		__m256i m = _mm256_setzero_si256();
+		for (i = 0; i < setlen; i++)
+			m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, needles[i]));
+		unsigned int mask = _mm256_movemask_epi8(m);
+		if (mask)
+			return p + __builtin_ctz(mask);
+		p += 32;
+	}
+	return simple_find_any_sse2(p, end, set, setlen);
+}
+
+#endif /* SIMPLE_BUFFER_X86_SIMD */
+
+static const struct simple_search_ops simple_search_scalar = {
+	"scalar",
+	simple_find_byte_scalar,
+	simple_find_pair_scalar,
+	simple_find_any_scalar
+};
+
+#ifdef SIMPLE_BUFFER_X86_SIMD
+static const struct simple_search_ops simple_search_sse2 = {
+	"sse2",
+	simple_find_byte_sse2,
+	simple_find_pair_sse2,
+	simple_find_any_sse2
+};
+
+static const struct simple_search_ops simple_search_avx2 = {
+	"avx2",
+	simple_find_byte_avx2,
+	simple_find_pair_avx2,
+	simple_find_any_avx2
+};
+#endif
+
+/** Return the search implementation selected for this CPU.
+ * Loops of several threads may race to select it: they all store the same
+ * pointer, atomically.
+ */
+static inline
+const struct simple_search_ops *
+simple_search_get_ops(void)
+{
+	static const struct simple_search_ops *cached = NULL;
+	const struct simple_search_ops *ops =
+		__atomic_load_n(&cached, __ATOMIC_ACQUIRE);
+	if (ops)
+		return ops;
+	ops = &simple_search_scalar;
+#ifdef SIMPLE_BUFFER_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		ops = &simple_search_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		ops = &simple_search_sse2;
+#endif
+	__atomic_store_n(&cached, ops, __ATOMIC_RELEASE);
+	return ops;
+}
+
+static inline
+const char *
+simple_buffer_search_start(struct simple_buffer * const buf)
+{
+	if (buf->userptr < buf->head)
+		buf->userptr = buf->head;
+	return buf->userptr;
+}
+
+/** Find byte `c` between userptr and tail.
+ * @return pointer to the match, NULL if not found yet.
+ */
+static inline
+char *
+simple_buffer_find_byte(struct simple_buffer * const buf, char c)
+{
+	const char *p = simple_buffer_search_start(buf);
+	p = simple_search_get_ops()->find_byte(p, buf->tail, c);
+	buf->userptr = p ? (char *) p : buf->tail;
+	return (char *) p;
+}
+
+/** Find the two-byte sequence `c0` `c1` (e.g. "\r\n") between userptr and
+ * tail.
+ * On a miss, userptr stops before the last byte, which may be `c0`.
+ * @return pointer to `c0` of the match, NULL if not found yet.
+ */
+static inline
+char *
+simple_buffer_find_pair(struct simple_buffer * const buf, char c0, char c1)
+{
+	const char *p = simple_buffer_search_start(buf);
+	p = simple_search_get_ops()->find_pair(p, buf->tail, c0, c1);
+	if (p)
+		buf->userptr = (char *) p;
+	else if (buf->tail - buf->userptr > 1)
+		buf->userptr = buf->tail - 1;
+	return (char *) p;
+}
+
+/** Find the first byte between userptr and tail that belongs to `set`.
+ * Sets larger than SIMPLE_SEARCH_SET_MAX bytes are searched with the scalar
+ * implementation.
+ * @return pointer to the match, NULL if not found yet.
+ */
+static inline
+char *
+simple_buffer_find_any(struct simple_buffer * const buf,
+		const char *set, size_t setlen)
+{
+	const char *p = simple_buffer_search_start(buf);
+	p = simple_search_get_ops()->find_any(p, buf->tail, set, setlen);
+	buf->userptr = p ? (char *) p : buf->tail;
+	return (char *) p;
+}
 
 #endif
 
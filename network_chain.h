@@ -0,0 +1,427 @@
+/*
+ * This file is part of libsimplenet.
+ *
+ * Copyright (C) 2010 Greg Leclercq <ggl@0x80.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 or version 3.0 only.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef _NETWORK_CHAIN_
+#define _NETWORK_CHAIN_ 1
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+
+#include "network_list.h"
+
+/* Maximum number of iovecs handed to a single writev(2). */
+#define CHAIN_IOV_BATCH	64
+
+typedef void (*chain_release_t)(void *ctx, const char *data, size_t len);
+
+/*
+ *  segments
+ *  v
+ * [seg]--->[seg]--->[seg]
+ *  data     data     data
+ *  v        v        v
+ *  |--|XXXX|XXXXXXX| |XXX|000|
+ *     ^    ^         ^   ^   ^
+ *   head  tail     head tail end
+ *
+ * A segment is either owned by the chain (its storage follows the header and
+ * is `segment_size` bytes long) or references memory owned by the caller, in
+ * which case `release` is called with the original (data, len) once its
+ * bytes are consumed.
+ * A file segment refers to the bytes [offset, file_end) of `fd` instead of
+ * memory. It is sent with sendfile(2) and its `release` is called with a NULL
+ * data pointer, e.g. to close the file.
+ */
+struct chain_segment {
+	struct list_head list;
+	char	*data;
+	char	*head;
+	char	*tail;
+	char	*end;
+	int	fd;
+	off_t	offset;
+	off_t	file_end;
+	chain_release_t release;
+	void	*ctx;
+};
+
+struct chain_buffer {
+	struct list_head segments;
+	size_t	 size;
+	uint32_t segment_size;
+	uint32_t nr_segments;
+};
+
+
+static inline
+void
+chain_buffer_init(struct chain_buffer *chain, uint32_t segment_size)
+{
+	INIT_LIST_HEAD(&chain->segments);
+	chain->size = 0;
+	chain->segment_size = segment_size;
+	chain->nr_segments = 0;
+}
+
+static inline
+struct chain_segment *
+chain_segment_first(struct chain_buffer *chain)
+{
+	if (list_empty(&chain->segments))
+		return NULL;
+	return list_first_entry(&chain->segments, struct chain_segment, list);
+}
+
+static inline
+struct chain_segment *
+chain_segment_last(struct chain_buffer *chain)
+{
+	if (list_empty(&chain->segments))
+		return NULL;
+	return list_entry(chain->segments.prev, struct chain_segment, list);
+}
+
+static inline
+int
+chain_segment_is_file(const struct chain_segment *seg)
+{
+	return seg->fd >= 0;
+}
+
+/** @return 1 if the segment stores its bytes, 0 for memory of the caller
+ * or a file. */
+static inline
+int
+chain_segment_is_owned(const struct chain_segment *seg)
+{
+	return seg->data == (const char *) (seg + 1);
+}
+
+static inline
+size_t
+chain_segment_len(const struct chain_segment *seg)
+{
+	if (chain_segment_is_file(seg))
+		return seg->file_end - seg->offset;
+	return seg->tail - seg->head;
+}
+
+static inline
+void
+chain_segment_free(struct chain_buffer *chain, struct chain_segment *seg)
+{
+	list_del(&seg->list);
+	chain->nr_segments--;
+	if (seg->release) {
+		if (chain_segment_is_file(seg))
+			seg->release(seg->ctx, NULL, 0);
+		else
+			seg->release(seg->ctx, seg->data, seg->end - seg->data);
+	}
+	free(seg);
+}
+
+/** Free every segment of the chain.
+ * The chain itself stays initialized and can be reused.
+ */
+static inline
+void
+chain_buffer_clear(struct chain_buffer *chain)
+{
+	struct chain_segment *seg;
+	while ((seg = chain_segment_first(chain)) != NULL)
+		chain_segment_free(chain, seg);
+	chain->size = 0;
+}
+
+static inline
+struct chain_buffer *
+chain_buffer_new(uint32_t segment_size)
+{
+	struct chain_buffer *chain = malloc(sizeof(*chain));
+	if (chain == NULL) return NULL;
+	chain_buffer_init(chain, segment_size);
+	return chain;
+}
+
+static inline
+void
+chain_buffer_free(struct chain_buffer *chain)
+{
+	assert(chain != NULL);
+	chain_buffer_clear(chain);
+	free(chain);
+}
+
+static inline
+size_t
+chain_buffer_size(struct chain_buffer *chain)
+{
+	return chain->size;
+}
+
+static inline
+struct chain_segment *
+chain_segment_new(struct chain_buffer *chain)
+{
+	struct chain_segment *seg = malloc(sizeof(*seg) + chain->segment_size);
+	if (seg == NULL) return NULL;
+	seg->data = (char *) (seg + 1);
+	seg->head = seg->data;
+	seg->tail = seg->head;
+	seg->end = seg->data + chain->segment_size;
+	seg->fd = -1;
+	seg->offset = 0;
+	seg->file_end = 0;
+	seg->release = NULL;
+	seg->ctx = NULL;
+	list_add_tail(&seg->list, &chain->segments);
+	chain->nr_segments++;
+	return seg;
+}
+
+/** Copy data at the end of the chain.
+ * Fill the free space of the last owned segment, then add new segments.
+ * Bytes already in the chain are never moved.
+ * @return 0 on success, errno value on error.
+ */
+static inline
+int
+chain_buffer_append(struct chain_buffer *chain,
+		const char *data, size_t data_len)
+{
+	struct chain_segment *seg = chain_segment_last(chain);
+	while (data_len) {
+		if (seg == NULL || !chain_segment_is_owned(seg) ||
+				seg->tail == seg->end) {
+			seg = chain_segment_new(chain);
+			if (seg == NULL) return errno;
+		}
+		size_t len = seg->end - seg->tail;
+		if (len > data_len)
+			len = data_len;
+		memcpy(seg->tail, data, len);
+		seg->tail += len;
+		chain->size += len;
+		data += len;
+		data_len -= len;
+	}
+	return 0;
+}
+
+/** Move the segments of `src` to the end of `dst`, leaving `src` empty.
+ * Nothing is copied: the bytes stay where they are. The empty segment kept
+ * at the end of `dst` by chain_buffer_pull() is dropped first, so that it
+ * does not come before the bytes of `src`.
+ */
+static inline
+void
+chain_buffer_splice(struct chain_buffer *dst, struct chain_buffer *src)
+{
+	struct chain_segment *seg = chain_segment_last(dst);
+	if (list_empty(&src->segments))
+		return ;
+	if (seg && chain_segment_is_owned(seg) && seg->tail == seg->head)
+		chain_segment_free(dst, seg);
+	list_splice_tail_init(&src->segments, &dst->segments);
+	dst->size += src->size;
+	dst->nr_segments += src->nr_segments;
+	src->size = 0;
+	src->nr_segments = 0;
+}
+
+/** Append a reference to memory owned by the caller.
+ * Nothing is copied: the memory must stay valid until `release` is called
+ * with (ctx, data, len), which happens once the bytes were consumed by
+ * chain_buffer_pull() or dropped by chain_buffer_clear(). `release` may be
+ * NULL for static data.
+ * @return 0 on success, errno value on error.
+ */
+static inline
+int
+chain_buffer_append_ref(struct chain_buffer *chain,
+		const char *data, size_t data_len,
+		chain_release_t release, void *ctx)
+{
+	struct chain_segment *seg = malloc(sizeof(*seg));
+	if (seg == NULL) return errno;
+	seg->data = (char *) data;
+	seg->head = seg->data;
+	seg->tail = seg->head + data_len;
+	seg->end = seg->tail;
+	seg->fd = -1;
+	seg->offset = 0;
+	seg->file_end = 0;
+	seg->release = release;
+	seg->ctx = ctx;
+	list_add_tail(&seg->list, &chain->segments);
+	chain->nr_segments++;
+	chain->size += data_len;
+	return 0;
+}
+
+/** Append `len` bytes of file `fd` starting at `offset`.
+ * They are sent with sendfile(2), in order with the bytes queued before and
+ * after them. `release` is called with (ctx, NULL, 0) once they were sent or
+ * dropped, right away when `len` is 0; the chain never closes `fd` by itself.
+ * @return 0 on success, errno value on error.
+ */
+static inline
+int
+chain_buffer_append_file(struct chain_buffer *chain,
+		int fd, off_t offset, size_t len,
+		chain_release_t release, void *ctx)
+{
+	struct chain_segment *seg;
+	if (len == 0) {
+		if (release)
+			release(ctx, NULL, 0);
+		return 0;
+	}
+	/* the empty segment kept by chain_buffer_pull() must not come first */
+	seg = chain_segment_last(chain);
+	if (seg && chain_segment_is_owned(seg) && seg->tail == seg->head)
+		chain_segment_free(chain, seg);
+	seg = malloc(sizeof(*seg));
+	if (seg == NULL) return errno;
+	seg->data = NULL;
+	seg->head = NULL;
+	seg->tail = NULL;
+	seg->end = NULL;
+	seg->fd = fd;
+	seg->offset = offset;
+	seg->file_end = offset + len;
+	seg->release = release;
+	seg->ctx = ctx;
+	list_add_tail(&seg->list, &chain->segments);
+	chain->nr_segments++;
+	chain->size += len;
+	return 0;
+}
+
+/** Describe the first bytes of the chain with at most `iovcnt` iovecs.
+ * It stops at the first file segment.
+ * @return number of iovecs filled.
+ */
+static inline
+int
+chain_buffer_iovec(struct chain_buffer *chain, struct iovec *iov, int iovcnt)
+{
+	struct list_head *pos;
+	int i = 0;
+	__list_for_each(pos, &chain->segments) {
+		if (i == iovcnt)
+			break;
+		struct chain_segment *seg;
+		seg = list_entry(pos, struct chain_segment, list);
+		if (chain_segment_is_file(seg))
+			break;
+		if (seg->tail == seg->head)
+			continue;
+		iov[i].iov_base = seg->head;
+		iov[i].iov_len = seg->tail - seg->head;
+		i++;
+	}
+	return i;
+}
+
+/** Consume `len` bytes from the front of the chain.
+ * Segments are freed (or released) as soon as they are fully consumed.
+ */
+static inline
+int
+chain_buffer_pull(struct chain_buffer *chain, size_t len)
+{
+	struct chain_segment *seg;
+	if (len > chain->size)
+		len = chain->size;
+	chain->size -= len;
+	while ((seg = chain_segment_first(chain)) != NULL) {
+		size_t seglen = chain_segment_len(seg);
+		if (len < seglen) {
+			if (chain_segment_is_file(seg))
+				seg->offset += len;
+			else
+				seg->head += len;
+			break;
+		}
+		len -= seglen;
+		if (chain_segment_is_owned(seg) &&
+				seg->list.next == &chain->segments) {
+			/* keep the last owned segment for the next append */
+			seg->head = seg->data;
+			seg->tail = seg->head;
+			break;
+		}
+		chain_segment_free(chain, seg);
+	}
+	return 0;
+}
+
+/** Send the first segment of the chain, which must be a file segment, with
+ * a single sendfile(2). Partial writes update the segment offset.
+ * @return number of bytes written, -1 on error (errno is set).
+ */
+static inline
+ssize_t
+chain_buffer_sendfile(struct chain_buffer *chain, int fd)
+{
+	struct chain_segment *seg = chain_segment_first(chain);
+	assert(seg != NULL && chain_segment_is_file(seg));
+	off_t offset = seg->offset;
+	ssize_t n = sendfile(fd, seg->fd, &offset, chain_segment_len(seg));
+	if (n == 0) {
+		/* file shorter than announced: nothing more will come */
+		errno = EIO;
+		return -1;
+	}
+	if (n > 0)
+		chain_buffer_pull(chain, n);
+	return n;
+}
+
+/** Write as much of the chain as possible to fd with a single writev(2),
+ * or a single sendfile(2) when the chain starts with a file segment.
+ * @return number of bytes written, -1 on error (errno is set).
+ */
+static inline
+ssize_t
+chain_buffer_write(struct chain_buffer *chain, int fd)
+{
+	struct chain_segment *seg = chain_segment_first(chain);
+	if (seg && chain_segment_is_file(seg))
+		return chain_buffer_sendfile(chain, fd);
+	struct iovec iov[CHAIN_IOV_BATCH];
+	int iovcnt = chain_buffer_iovec(chain, iov, CHAIN_IOV_BATCH);
+	if (iovcnt == 0)
+		return 0;
+	ssize_t n = writev(fd, iov, iovcnt);
+	if (n > 0)
+		chain_buffer_pull(chain, n);
+	return n;
+}
+
+
+#endif
+
+/* vim: ts=8:sw=8:noet
+*/
@@ -21,6 +21,7 @@
 #include <assert.h>
 
 #include "network_buffer.h"
+#include "network_chain.h"
 #include "network_socket.h"
 #include "network_client.h"
 
@@ -122,16 +123,31 @@ network_client_send(struct network_client *client,
 
 
 
+int
+network_client_send_chain(struct network_client *client,
+	struct chain_buffer *chain)
+{
+    while (chain_buffer_size(chain)) {
+	ssize_t n = chain_buffer_write(chain, client->fd);
+	if (n == 0) return EAGAIN;
+	if (n == -1) return errno;
+    }
+    return 0;
+}
+
+
+
 int
 network_client_recv(struct network_client *client,
 	struct simple_buffer *data, unsigned int len)
 {
-    simple_buffer_resize_tail(data, len);
+    if (simple_buffer_reserve(data, len) == NULL)
+	return errno;
     while (len) {
 	ssize_t n = read(client->fd, simple_buffer_get_tail(data), len);
 	if (n == 0)return EAGAIN;
 	if (n == -1) return errno;
-	simple_buffer_move_tail(data, n);
+	simple_buffer_commit(data, n);
 	len -= n;
     }
     return 0;
@@ -16,6 +16,8 @@
 #ifndef _NETwORK_CLIENT_H_
 #define _NETwORK_CLIENT_H_ 1
 
+#include "network_buffer.h"
+#include "network_chain.h"
 #include "network_socket.h"
 
 
@@ -31,6 +33,9 @@ int network_client_close(struct network_client *client);
 int network_client_connect(struct network_client *client, void *conf);
 int network_client_send(struct network_client *client,
 	struct simple_buffer *data, unsigned int len);
+/* Flush the whole chain, one writev(2) per batch of segments. */
+int network_client_send_chain(struct network_client *client,
+	struct chain_buffer *chain);
 int network_client_recv(struct network_client *client,
 	struct simple_buffer *data, unsigned int len);
 
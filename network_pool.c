@@ -0,0 +1,139 @@
+/*
+ * This file is part of libsimplenet.
+ *
+ * Copyright (C) 2010 Greg Leclercq <ggl@0x80.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 or version 3.0 only.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+#include <signal.h>
+
+#include "network_pool.h"
+
+
+static
+void *
+thread_pool_run(void *pool_)
+{
+	struct thread_pool *pool = pool_;
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (pool->nr_jobs == 0 && !pool->stopping)
+			pthread_cond_wait(&pool->cond, &pool->lock);
+		if (pool->nr_jobs == 0)
+			break;
+		struct thread_pool_job job = pool->jobs[pool->head];
+		pool->head = (pool->head + 1) % pool->max_jobs;
+		pool->nr_jobs--;
+		pthread_mutex_unlock(&pool->lock);
+		job.fn(job.arg);
+		pthread_mutex_lock(&pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+struct thread_pool *
+thread_pool_new(uint32_t nr_threads, uint32_t max_jobs)
+{
+	if (max_jobs == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (nr_threads == 0) {
+		long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		nr_threads = nr_cpus > 0 ? nr_cpus : 1;
+	}
+	struct thread_pool *pool = malloc(sizeof(*pool));
+	if (pool == NULL) return NULL;
+	pool->jobs = malloc(max_jobs * sizeof(*pool->jobs));
+	pool->threads = malloc(nr_threads * sizeof(*pool->threads));
+	if (pool->jobs == NULL || pool->threads == NULL)
+		goto fail_alloc;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+	pool->max_jobs = max_jobs;
+	pool->head = 0;
+	pool->nr_jobs = 0;
+	pool->nr_threads = 0;
+	pool->stopping = 0;
+
+	/* Signals are left to the application threads. */
+	sigset_t sigset, sigsaved;
+	sigfillset(&sigset);
+	pthread_sigmask(SIG_BLOCK, &sigset, &sigsaved);
+	int err = 0;
+	for (; pool->nr_threads < nr_threads; pool->nr_threads++) {
+		err = pthread_create(&pool->threads[pool->nr_threads], NULL,
+				thread_pool_run, pool);
+		if (err) break;
+	}
+	pthread_sigmask(SIG_SETMASK, &sigsaved, NULL);
+	if (err) {
+		thread_pool_free(pool);
+		errno = err;
+		return NULL;
+	}
+
+	return pool;
+
+fail_alloc:
+	free(pool->jobs);
+	free(pool->threads);
+	free(pool);
+	errno = ENOMEM;
+	return NULL;
+}
+
+void
+thread_pool_free(struct thread_pool *pool)
+{
+	uint32_t i;
+	assert(pool != NULL);
+	pthread_mutex_lock(&pool->lock);
+	pool->stopping = 1;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+	for (i = 0; i < pool->nr_threads; i++)
+		pthread_join(pool->threads[i], NULL);
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->jobs);
+	free(pool->threads);
+	free(pool);
+}
+
+int
+thread_pool_submit(struct thread_pool *pool, thread_pool_job_t fn, void *arg)
+{
+	int err = 0;
+	pthread_mutex_lock(&pool->lock);
+	if (pool->stopping) {
+		err = ESHUTDOWN;
+	} else if (pool->nr_jobs == pool->max_jobs) {
+		err = EAGAIN;
+	} else {
+		uint32_t tail = (pool->head + pool->nr_jobs) % pool->max_jobs;
+		pool->jobs[tail].fn = fn;
+		pool->jobs[tail].arg = arg;
+		pool->nr_jobs++;
+		pthread_cond_signal(&pool->cond);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return err;
+}
+
+
+/* vim: ts=8:sw=8:noet
+*/
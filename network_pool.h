@@ -0,0 +1,70 @@
+/*
+ * This file is part of libsimplenet.
+ *
+ * Copyright (C) 2010 Greg Leclercq <ggl@0x80.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 or version 3.0 only.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef SIMPLE_NETWORK_POOL_H_
+#define SIMPLE_NETWORK_POOL_H_ 1
+
+#include <stdint.h>
+#include <pthread.h>
+
+typedef void (*thread_pool_job_t)(void *arg);
+
+struct thread_pool_job {
+	thread_pool_job_t fn;
+	void	*arg;
+};
+
+/* Fixed set of threads running jobs from a bounded FIFO.
+ * Meant for request handlers that return EINPROGRESS and finish the request
+ * with server_request_complete() from a job.
+ */
+struct thread_pool {
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	struct thread_pool_job *jobs;
+	uint32_t	max_jobs;
+	uint32_t	head;
+	uint32_t	nr_jobs;
+	uint32_t	nr_threads;
+	pthread_t	*threads;
+	int		stopping;
+};
+
+/** Allocate a thread pool and start its threads.
+ * @param nr_threads number of threads, 0 for one per online CPU.
+ * @param max_jobs maximum number of jobs waiting for a thread.
+ * @return pointer to an allocated `struct thread_pool`. NULL if an error
+ * happened (errno is set).
+ * @see thread_pool_free().
+ */
+struct thread_pool *thread_pool_new(uint32_t nr_threads, uint32_t max_jobs);
+
+/** Run the jobs still queued, stop the threads and free the pool.
+ * @param pool pointer to an allocated `struct thread_pool`.
+ */
+void thread_pool_free(struct thread_pool *pool);
+
+/** Queue a job. Safe to call from any thread.
+ * @return 0 on success, EAGAIN if `max_jobs` jobs are already waiting,
+ * ESHUTDOWN if the pool is being freed.
+ */
+int thread_pool_submit(struct thread_pool *pool, thread_pool_job_t fn,
+		void *arg);
+
+
+#endif
+
+/* vim: ts=8:sw=8:noet
+*/
@@ -0,0 +1,282 @@
+/*
+ * This file is part of libsimplenet.
+ *
+ * Copyright (C) 2010 Greg Leclercq <ggl@0x80.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 or version 3.0 only.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef _NETWORK_QUEUE_
+#define _NETWORK_QUEUE_ 1
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+
+/* Size of a cache line, used to keep producers and consumer apart. */
+#define QUEUE_CACHELINE	64
+
+/*
+ * Bounded lock-free queue with many producers and a single consumer.
+ *
+ *            head                 tail
+ *            v                    v
+ *  cells: |..|XXXX|XXXX|XXXX|XXXX|..|..|..|
+ *
+ * Every cell carries a sequence number telling whose turn it is: a producer
+ * may fill cell `pos & mask` when its sequence is `pos`, the consumer may
+ * read it when its sequence is `pos + 1`. Producers reserve a cell with a
+ * compare-and-swap on `tail`; the consumer owns `head` and needs no atomic
+ * read-modify-write at all.
+ * A value larger than a pointer can live in an array of the caller with as
+ * many entries as the ring, indexed by mpsc_ring_index(): the producer
+ * fills its entry between mpsc_ring_claim() and mpsc_ring_publish(), the
+ * consumer reads it between mpsc_ring_front() and mpsc_ring_consume().
+ */
+struct mpsc_ring_cell {
+	uint32_t	seq;
+	uintptr_t	value;
+};
+
+struct mpsc_ring {
+	struct mpsc_ring_cell *cells;
+	uint32_t mask;
+	char	 pad0[QUEUE_CACHELINE];
+	uint32_t tail;
+	char	 pad1[QUEUE_CACHELINE];
+	uint32_t head;
+};
+
+
+/** Initialize a ring of `size` cells. `size` must be a power of 2.
+ * @return 0 on success, errno value on error.
+ */
+static inline
+int
+mpsc_ring_init(struct mpsc_ring *ring, uint32_t size)
+{
+	uint32_t i;
+	if (size == 0 || (size & (size - 1)))
+		return EINVAL;
+	ring->cells = malloc(size * sizeof(*ring->cells));
+	if (ring->cells == NULL) return errno;
+	for (i = 0; i < size; i++)
+		ring->cells[i].seq = i;
+	ring->mask = size - 1;
+	ring->tail = 0;
+	ring->head = 0;
+	return 0;
+}
+
+static inline
+void
+mpsc_ring_destroy(struct mpsc_ring *ring)
+{
+	free(ring->cells);
+	ring->cells = NULL;
+}
+
+/** @return the index of the cell at position `pos`, from 0 to size - 1. */
+static inline
+uint32_t
+mpsc_ring_index(const struct mpsc_ring *ring, uint32_t pos)
+{
+	return pos & ring->mask;
+}
+
+/** Reserve the next cell. Safe to call from any number of threads.
+ * The cell must then be filled with mpsc_ring_publish().
+ * @param claimed set to the position of the cell.
+ * @return 0 on success, EAGAIN if the ring is full.
+ */
+static inline
+int
+mpsc_ring_claim(struct mpsc_ring *ring, uint32_t *claimed)
+{
+	struct mpsc_ring_cell *cell;
+	uint32_t pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	for (;;) {
+		cell = &ring->cells[pos & ring->mask];
+		uint32_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		int32_t diff = (int32_t) (seq - pos);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&ring->tail, &pos,
+					pos + 1, 1, __ATOMIC_RELAXED,
+					__ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			return EAGAIN;
+		} else {
+			pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+		}
+	}
+	*claimed = pos;
+	return 0;
+}
+
+/** Hand the cell reserved by mpsc_ring_claim() over to the consumer. */
+static inline
+void
+mpsc_ring_publish(struct mpsc_ring *ring, uint32_t pos, uintptr_t value)
+{
+	struct mpsc_ring_cell *cell = &ring->cells[pos & ring->mask];
+	cell->value = value;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+/** Queue a value. Safe to call from any number of threads.
+ * @return 0 on success, EAGAIN if the ring is full.
+ */
+static inline
+int
+mpsc_ring_push(struct mpsc_ring *ring, uintptr_t value)
+{
+	uint32_t pos;
+	if (mpsc_ring_claim(ring, &pos))
+		return EAGAIN;
+	mpsc_ring_publish(ring, pos, value);
+	return 0;
+}
+
+/** Look at the oldest value, without dequeuing it. Only the consumer
+ * thread may call it.
+ * @param pos set to the position of its cell.
+ * @return 0 on success, EAGAIN if the ring is empty.
+ */
+static inline
+int
+mpsc_ring_front(struct mpsc_ring *ring, uintptr_t *value, uint32_t *pos)
+{
+	struct mpsc_ring_cell *cell = &ring->cells[ring->head & ring->mask];
+	uint32_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+	if ((int32_t) (seq - (ring->head + 1)) < 0)
+		return EAGAIN;
+	*value = cell->value;
+	*pos = ring->head;
+	return 0;
+}
+
+/** Dequeue the value returned by mpsc_ring_front() and give its cell back
+ * to the producers.
+ */
+static inline
+void
+mpsc_ring_consume(struct mpsc_ring *ring)
+{
+	uint32_t pos = ring->head;
+	struct mpsc_ring_cell *cell = &ring->cells[pos & ring->mask];
+	__atomic_store_n(&cell->seq, pos + ring->mask + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&ring->head, pos + 1, __ATOMIC_RELAXED);
+}
+
+/** Dequeue a value. Only the consumer thread may call it.
+ * @return 0 on success, EAGAIN if the ring is empty.
+ */
+static inline
+int
+mpsc_ring_pop(struct mpsc_ring *ring, uintptr_t *value)
+{
+	uint32_t pos;
+	if (mpsc_ring_front(ring, value, &pos))
+		return EAGAIN;
+	mpsc_ring_consume(ring);
+	return 0;
+}
+
+/** Number of queued values, as seen by any thread.
+ * It may be stale by the time it is used.
+ */
+static inline
+uint32_t
+mpsc_ring_size(struct mpsc_ring *ring)
+{
+	uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	return tail - head;
+}
+
+/*
+ * Unbounded intrusive queue with many producers and a single consumer.
+ * Producers swap themselves in as the new `head` and then link the previous
+ * head to their node; the consumer walks from `tail`. A node is embedded in
+ * the queued object, so pushing never allocates and never fails. `stub` keeps
+ * the queue non-empty so that head and tail are never NULL.
+ */
+struct mpsc_node {
+	struct mpsc_node *next;
+};
+
+struct mpsc_queue {
+	struct mpsc_node *head;
+	char	pad0[QUEUE_CACHELINE];
+	struct mpsc_node *tail;
+	struct mpsc_node stub;
+};
+
+
+static inline
+void
+mpsc_queue_init(struct mpsc_queue *queue)
+{
+	queue->stub.next = NULL;
+	queue->head = &queue->stub;
+	queue->tail = &queue->stub;
+}
+
+/** Queue a node. Safe to call from any number of threads. */
+static inline
+void
+mpsc_queue_push(struct mpsc_queue *queue, struct mpsc_node *node)
+{
+	struct mpsc_node *prev;
+	__atomic_store_n(&node->next, NULL, __ATOMIC_RELAXED);
+	prev = __atomic_exchange_n(&queue->head, node, __ATOMIC_ACQ_REL);
+	__atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+}
+
+/** Dequeue a node. Only the consumer thread may call it.
+ * A producer interrupted between its two steps hides the nodes queued after
+ * it for a moment: NULL is returned and the producer must wake the consumer
+ * up once its push returned.
+ * @return the oldest node, NULL if none is available.
+ */
+static inline
+struct mpsc_node *
+mpsc_queue_pop(struct mpsc_queue *queue)
+{
+	struct mpsc_node *tail = queue->tail;
+	struct mpsc_node *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	if (tail == &queue->stub) {
+		if (next == NULL)
+			return NULL;
+		queue->tail = next;
+		tail = next;
+		next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+	}
+	if (next) {
+		queue->tail = next;
+		return tail;
+	}
+	if (tail != __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE))
+		return NULL;
+	mpsc_queue_push(queue, &queue->stub);
+	next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	if (next) {
+		queue->tail = next;
+		return tail;
+	}
+	return NULL;
+}
+
+
+#endif
+
+/* vim: ts=8:sw=8:noet
+*/
@@ -13,6 +13,7 @@
  * GNU General Public License for more details.
  */
 
+#define _GNU_SOURCE /* accept4 */
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
@@ -21,24 +22,123 @@
 #include <stdio.h>
 #include <signal.h>
 #include <syslog.h> /* only for log levels constants */
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/epoll.h>
+#include <arpa/inet.h>
 
 #include <ev.h>
 
 #include "network_list.h"
 #include "network_buffer.h"
+#include "network_chain.h"
 #include "network_socket.h"
+#include "network_uring.h"
 #include "network_server.h"
 
+/* Peer address of a connection, formatted in a temporary buffer. Only meant
+ * as a LOG_SERVER() argument, which is not evaluated for disabled levels.
+ */
+#define CLIENT_ADDR(client) \
+	peer_client_addr(client, (char [SERVER_ADDRSTRLEN]) {0}, SERVER_ADDRSTRLEN)
 
 static void server_callback_accept(struct ev_loop *, ev_io *, int);
-static void server_callback_read(struct ev_loop *, ev_io *, int);
+static void server_callback_handoff(struct ev_loop *, ev_async *, int);
+static void server_callback_complete(struct ev_loop *, ev_async *, int);
+static void server_callback_push(struct ev_loop *, ev_async *, int);
+static void server_callback_stop(struct ev_loop *, ev_async *, int);
+static void server_callback_timer(struct ev_loop *, ev_timer *, int);
+static void server_callback_flush(struct ev_loop *, ev_prepare *, int);
+static void server_callback_ready(struct ev_loop *, ev_check *, int);
+static void server_callback_idle(struct ev_loop *, ev_idle *, int);
 
 static void server_callback_read(struct ev_loop *, ev_io *, int);
 static void server_callback_write(struct ev_loop *, ev_io *, int);
 static void server_callback_disconnect(struct ev_loop *, ev_io *, int);
 
+/* I/O engine of a loop, see server_set_engine(). libev, the default, has
+ * none: the watchers of the connections do the work.
+ */
+struct server_engine {
+	const char *name;
+	/** Set up `engine_data`. @return 0 on success, errno value on error. */
+	int	(*init)(struct server_loop *);
+	/** Release `engine_data` once the connections are closed. */
+	void	(*destroy)(struct server_loop *);
+	/** Accept on the listener of the loop, NULL to leave it to libev. */
+	void	(*accept)(struct server_loop *);
+	/** @return 0 on success, errno value if the connection cannot be
+	 * taken. */
+	int	(*add)(struct server_loop *, struct peer_client *);
+	/** Forget a connection about to be closed, NULL if there is nothing
+	 * to do. */
+	void	(*close)(struct server_loop *, struct peer_client *);
+	void	(*read_start)(struct server_loop *, struct peer_client *);
+	void	(*read_stop)(struct server_loop *, struct peer_client *);
+	/** For engines that receive on their own: called by the read callback
+	 * instead of read(2) once the received bytes are processed, NULL
+	 * otherwise.
+	 * @return EAGAIN, or 0 once the peer closed its side. */
+	int	(*read)(struct server_loop *, struct peer_client *);
+	/** Call server_callback_write() again once the socket is writable. */
+	void	(*wait_write)(struct server_loop *, struct peer_client *);
+	/** Write the connections of `dirty`, see server_callback_flush(). */
+	void	(*flush)(struct server_loop *);
+};
+
+#ifdef URING_SUPPORTED
+static const struct server_engine server_engine_uring;
+#endif
+static const struct server_engine server_engine_epoll;
+
+static
+const struct server_engine *const server_engines[] = {
+[SERVER_ENGINE_LIBEV]	NULL,
+#ifdef URING_SUPPORTED
+[SERVER_ENGINE_URING]	&server_engine_uring,
+#endif
+[SERVER_ENGINE_EPOLL]	&server_engine_epoll
+};
+
+/* State of a connection in the I/O engine of its loop, in its connection
+ * slot. CONN_READ and CONN_WRITE tell what the loop wants from it, the other
+ * flags belong to the engine.
+ */
+#define CONN_READ		0x001 /* the connection is read */
+#define CONN_WRITE		0x002 /* a response waits to be written */
+#define CONN_URING_RECV		0x004 /* a multishot recv is armed */
+#define CONN_URING_CANCEL	0x008 /* and its cancellation was requested */
+#define CONN_URING_EOF		0x010 /* the peer closed its side */
+#define CONN_URING_SENDING	0x020 /* a send is in flight */
+#define CONN_URING_POLL		0x040 /* waiting for the socket to be writable */
+#define CONN_URING_FIXED	0x080 /* the socket is a registered file */
+
+/* Readiness of the socket of a connection, in `client->ready`. The epoll
+ * engine sets it on an edge and clears it once a read or a write says
+ * otherwise.
+ */
+#define PEER_READABLE		0x1 /* the socket has bytes to read */
+#define PEER_WRITABLE		0x2 /* the socket takes more bytes */
+
+/* Only used by the signal handlers. */
 struct server *_server = NULL;
 
+/* Loop running in the current thread. */
+static __thread struct server_loop *_server_loop = NULL;
+
+/* Connection whose request handler is running, for server_request_defer(). */
+static __thread struct peer_client *_server_client = NULL;
+
+/* Bytes queued by server_send() for a connection. */
+struct server_push {
+	struct mpsc_node node;
+	server_conn_t id;
+	size_t	len;
+	char	data[];
+};
+
 static int server_listen_unix(struct server *, const void *);
 static int server_listen_tcp(struct server *, const void *);
 
@@ -69,13 +169,39 @@ server_new(socket_type_t type, uint32_t max_clients)
 	struct server *server = malloc(sizeof(*server));
 	if (server == NULL) return NULL;
 	server->type = type;
-	memset(&server->watcher, 0, sizeof(server->watcher));
 	server->fd = -1;
-	INIT_LIST_HEAD(&server->clients);
 	server->nr_clients = 0;
 	server->max_clients = max_clients;
 	server->addr = NULL;
 	memset(&server->callbacks, 0, sizeof(server->callbacks));
+	server->flags = 0;
+	server->buffer_size = 16*getpagesize();
+	server->buffer_policy.growth_factor = SIMPLE_BUFFER_GROWTH_FACTOR;
+	server->buffer_policy.growth_cap = SIMPLE_BUFFER_GROWTH_CAP;
+	server->buffer_policy.retain_size = server->buffer_size;
+	server->accept_batch = SERVER_ACCEPT_BATCH;
+	server->log_level = LOG_DEBUG;
+	memset(server->timeouts, 0, sizeof(server->timeouts));
+	server->write_high = 0;
+	server->write_low = 0;
+	server->write_budget = 0;
+	server->write_pending = 0;
+	server->cork = 0;
+	server->read_budget_bytes = 0;
+	server->read_budget_requests = 0;
+	server->engine = SERVER_ENGINE_LIBEV;
+	server->nr_loops = 1;
+	server->loops = NULL;
+	server->balance = NULL;
+	memset(&server->acceptor, 0, sizeof(server->acceptor));
+	server->balance_next = 0;
+	server->balance_seed = getpid();
+	server->nr_running = 0;
+	server->nr_senders = 0;
+	pthread_mutex_init(&server->drain_lock, NULL);
+	pthread_cond_init(&server->drain_cond, NULL);
+	server->stopping = 0;
+	server->stop_err = 0;
 
 	return server;
 }
@@ -84,41 +210,49 @@ void
 server_free(struct server *server)
 {
 	assert(server != NULL);
+	assert(server->loops == NULL);
+	if (server->fd != -1)
+		socket_close(server->fd);
 	if (server->addr)
 		free(server->addr);
+	if (_server == server)
+		_server = NULL;
+	pthread_cond_destroy(&server->drain_cond);
+	pthread_mutex_destroy(&server->drain_lock);
 	free(server);
 }
 
-static struct peer_client *peer_client_new(struct server *);
+static struct peer_client *peer_client_new(struct server_loop *);
 static void peer_client_free(struct peer_client *);
-static void server_add_client(struct server *, struct peer_client *);
-static void server_del_client(struct server *, struct peer_client *);
+static void server_loop_complete_requests(struct server_loop *);
+static int server_loop_add_client(struct server_loop *, struct peer_client *,
+		int);
+static void server_loop_del_client(struct server_loop *, struct peer_client *);
 
 int
 server_stop(struct server *server, int err)
 {
-	struct list_head *pos, *cur;
-	list_for_each_safe(pos, cur, &server->clients) {
-		struct peer_client *client;
-		client = list_entry(pos, struct peer_client, list);
-		ev_io_stop(EV_DEFAULT, &client->watcher_read);
-		ev_io_stop(EV_DEFAULT, &client->watcher_write);
-		socket_close(client->watcher_read.fd);
-		server_del_client(client->server, client);
-		peer_client_free(client);
+	uint32_t i, nr_running;
+	/* the first call wins, from a signal handler or any thread */
+	if (__atomic_exchange_n(&server->stopping, 1, __ATOMIC_ACQ_REL))
+		return 0;
+	__atomic_store_n(&server->stop_err, err, __ATOMIC_RELEASE);
+	nr_running = __atomic_load_n(&server->nr_running, __ATOMIC_ACQUIRE);
+	for (i = 0; i < nr_running; i++) {
+		struct server_loop *sloop = &server->loops[i];
+		ev_async_send(sloop->loop, &sloop->watcher_stop);
 	}
-	socket_close(server->fd);
-	if (server->callbacks.stop)
-		server->callbacks.stop(server->prv);
-	server_free(server);
-	ev_unloop(EV_DEFAULT, EVUNLOOP_ALL);
-	exit(err);
+	if (nr_running && server->balance)
+		ev_async_send(server->acceptor.loop,
+				&server->acceptor.watcher_stop);
+	return 0;
 }
 
 void
 server_stop_global(void)
 {
-	server_stop(_server, EXIT_SUCCESS);
+	if (_server)
+		server_stop(_server, EXIT_SUCCESS);
 }
 
 void
@@ -127,6 +261,337 @@ server_stop_sighandler(int signum)
 	server_stop_global();
 }
 
+struct server_loop *
+server_current_loop(void)
+{
+	return _server_loop;
+}
+
+server_engine_t
+server_loop_engine(const struct server_loop *sloop)
+{
+	/* a loop whose engine failed to start has none */
+	if (sloop->engine == NULL)
+		return SERVER_ENGINE_LIBEV;
+	return sloop->server->engine;
+}
+
+/** Responses are queued in `chain_write` rather than in `buffer_write`. */
+static inline
+int
+server_chain_mode(const struct server *server)
+{
+	return server->callbacks.do_request_chain &&
+		server->callbacks.framing.type == FRAMING_NONE;
+}
+
+const char *
+peer_client_addr(const struct peer_client *client, char *buf, size_t len)
+{
+	char ip[INET6_ADDRSTRLEN];
+	switch (client->addr.sa.sa_family) {
+	case AF_INET:
+		inet_ntop(AF_INET, &client->addr.in.sin_addr, ip, sizeof(ip));
+		snprintf(buf, len, "%s:%d", ip,
+			ntohs(client->addr.in.sin_port));
+		break;
+	case AF_INET6:
+		inet_ntop(AF_INET6, &client->addr.in6.sin6_addr,
+			ip, sizeof(ip));
+		snprintf(buf, len, "[%s]:%d", ip,
+			ntohs(client->addr.in6.sin6_port));
+		break;
+	case AF_UNIX:
+		snprintf(buf, len, "unix");
+		break;
+	default:
+		snprintf(buf, len, "unknown");
+	}
+	return buf;
+}
+
+server_conn_t
+server_client_id(const struct peer_client *client)
+{
+	return (server_conn_t) client->loop->id << 56 |
+		(server_conn_t) client->gen << 32 |
+		(uint32_t) client->watcher_read.fd;
+}
+
+/** Drop `count`, a number of server_send() or deferred request calls in
+ * progress, and wake up server_drain() when it reaches 0.
+ * Both happen under `drain_lock`: server_drain() cannot see 0, and let the
+ * server be freed, before the caller is done with the lock.
+ */
+static
+void
+server_drain_release(struct server *server, uint32_t *count)
+{
+	pthread_mutex_lock(&server->drain_lock);
+	if (__atomic_sub_fetch(count, 1, __ATOMIC_SEQ_CST) == 0)
+		pthread_cond_broadcast(&server->drain_cond);
+	pthread_mutex_unlock(&server->drain_lock);
+}
+
+/** Wait until `count`, a number of server_send() or deferred request calls
+ * in progress, drops to 0. Only once the loops stopped running.
+ */
+static
+void
+server_drain(struct server *server, uint32_t *count, const char *what)
+{
+	pthread_mutex_lock(&server->drain_lock);
+	uint32_t n = __atomic_load_n(count, __ATOMIC_SEQ_CST);
+	if (n)
+		LOG_SERVER(server, LOG_WARNING,
+			"waiting for %u %s in progress", n, what);
+	while (__atomic_load_n(count, __ATOMIC_SEQ_CST))
+		pthread_cond_wait(&server->drain_cond, &server->drain_lock);
+	pthread_mutex_unlock(&server->drain_lock);
+}
+
+int
+server_send(struct server *server, server_conn_t id,
+		const char *data, size_t len)
+{
+	uint32_t idx = id >> 56;
+	int err = 0;
+	/* server_loops_free() waits for the senders it may have missed */
+	__atomic_add_fetch(&server->nr_senders, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&server->nr_running, __ATOMIC_SEQ_CST) == 0) {
+		err = ESHUTDOWN;
+		goto out;
+	}
+	if (idx >= server->nr_loops) {
+		err = EINVAL;
+		goto out;
+	}
+	struct server_push *push = malloc(sizeof(*push) + len);
+	if (push == NULL) {
+		err = errno;
+		goto out;
+	}
+	push->id = id;
+	push->len = len;
+	memcpy(push->data, data, len);
+	struct server_loop *sloop = &server->loops[idx];
+	mpsc_queue_push(&sloop->pushes, &push->node);
+	/* one wakeup until the loop picks up the queue */
+	if (!__atomic_exchange_n(&sloop->push_wakeup, 1, __ATOMIC_ACQ_REL))
+		ev_async_send(sloop->loop, &sloop->watcher_push);
+out:
+	server_drain_release(server, &server->nr_senders);
+	return err;
+}
+
+struct server_request *
+server_request_defer(void)
+{
+	struct peer_client *client = _server_client;
+	if (client == NULL || client->deferred) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (server_chain_mode(client->loop->server)) {
+		errno = ENOTSUP;
+		return NULL;
+	}
+	struct server_request *req = malloc(sizeof(*req));
+	if (req == NULL) return NULL;
+	req->client = client;
+	req->loop = client->loop;
+	req->seq = client->seq_next++;
+	req->err = 0;
+	req->response = NULL;
+	req->data = NULL;
+	client->deferred = 1;
+	client->nr_inflight++;
+	__atomic_add_fetch(&client->loop->nr_inflight, 1, __ATOMIC_RELAXED);
+	return req;
+}
+
+struct simple_buffer *
+server_request_buffer(struct server_request *req)
+{
+	struct server *server = req->loop->server;
+	if (req->response)
+		return req->response;
+	req->response = simple_buffer_new(server->buffer_size);
+	if (req->response == NULL)
+		return NULL;
+	simple_buffer_set_flags(req->response, SIMPLE_BUFFER_COMPACT);
+	simple_buffer_set_policy(req->response, &server->buffer_policy);
+	return req->response;
+}
+
+void
+server_request_complete(struct server_request *req, int err)
+{
+	/* the loop may free req as soon as it is queued */
+	struct server_loop *sloop = req->loop;
+	struct server *server = sloop->server;
+	req->err = err;
+	mpsc_queue_push(&sloop->completions, &req->node);
+	ev_async_send(sloop->loop, &sloop->watcher_complete);
+	/* neither the loop nor the server is freed before this drops to 0 */
+	server_drain_release(server, &sloop->nr_inflight);
+}
+
+int
+server_set_buffer_policy(struct server *server,
+		const struct simple_buffer_policy *policy)
+{
+	if (policy->growth_factor < 100)
+		return EINVAL;
+	server->buffer_policy = *policy;
+	return 0;
+}
+
+int
+server_set_balancer(struct server *server, server_balance_t balance)
+{
+	server->balance = balance;
+	return 0;
+}
+
+uint32_t
+server_loop_load(struct server_loop *sloop)
+{
+	uint32_t load = __atomic_load_n(&sloop->nr_clients, __ATOMIC_RELAXED);
+	if (sloop->handoff.cells)
+		load += mpsc_ring_size(&sloop->handoff);
+	return load;
+}
+
+struct server_loop *
+server_balance_round_robin(struct server *server)
+{
+	return &server->loops[server->balance_next++ % server->nr_loops];
+}
+
+struct server_loop *
+server_balance_least_conn(struct server *server)
+{
+	struct server_loop *best = &server->loops[0];
+	uint32_t i, best_load = server_loop_load(best);
+	for (i = 1; i < server->nr_loops && best_load; i++) {
+		uint32_t load = server_loop_load(&server->loops[i]);
+		if (load < best_load) {
+			best = &server->loops[i];
+			best_load = load;
+		}
+	}
+	return best;
+}
+
+struct server_loop *
+server_balance_power_of_two(struct server *server)
+{
+	struct server_loop *a, *b;
+	a = &server->loops[rand_r(&server->balance_seed) % server->nr_loops];
+	b = &server->loops[rand_r(&server->balance_seed) % server->nr_loops];
+	return server_loop_load(b) < server_loop_load(a) ? b : a;
+}
+
+int
+server_set_accept_batch(struct server *server, uint32_t batch)
+{
+	if (batch == 0)
+		return EINVAL;
+	server->accept_batch = batch;
+	return 0;
+}
+
+int
+server_set_log_level(struct server *server, int level)
+{
+	server->log_level = level;
+	return 0;
+}
+
+/** Number of ticks covering `seconds`, rounded up. */
+static
+uint32_t
+server_timeout_ticks(double seconds)
+{
+	double ticks = seconds / SERVER_TIMER_TICK;
+	if (ticks >= WHEEL_MAX_DELAY)
+		return WHEEL_MAX_DELAY;
+	uint32_t nr = ticks;
+	return nr < ticks ? nr + 1 : nr;
+}
+
+int
+server_set_timeouts(struct server *server, double idle, double read,
+		double write)
+{
+	if (idle < 0 || read < 0 || write < 0)
+		return EINVAL;
+	server->timeouts[SERVER_TIMEOUT_IDLE] = server_timeout_ticks(idle);
+	server->timeouts[SERVER_TIMEOUT_READ] = server_timeout_ticks(read);
+	server->timeouts[SERVER_TIMEOUT_WRITE] = server_timeout_ticks(write);
+	return 0;
+}
+
+int
+server_set_write_watermarks(struct server *server, size_t high, size_t low)
+{
+	if (low > high)
+		return EINVAL;
+	server->write_high = high;
+	server->write_low = low;
+	return 0;
+}
+
+int
+server_set_write_budget(struct server *server, size_t budget)
+{
+	server->write_budget = budget;
+	return 0;
+}
+
+int
+server_set_cork(struct server *server, int cork)
+{
+	server->cork = cork;
+	return 0;
+}
+
+int
+server_set_read_budget(struct server *server, size_t bytes,
+		uint32_t requests)
+{
+	server->read_budget_bytes = bytes;
+	server->read_budget_requests = requests;
+	return 0;
+}
+
+int
+server_set_engine(struct server *server, server_engine_t engine)
+{
+	if ((unsigned int) engine > SERVER_ENGINE_EPOLL)
+		return EINVAL;
+	if (engine != SERVER_ENGINE_LIBEV && server_engines[engine] == NULL)
+		return ENOSYS;
+	server->engine = engine;
+	return 0;
+}
+
+int
+server_set_loops(struct server *server, uint32_t nr_loops)
+{
+	if (nr_loops == 0) {
+		long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		nr_loops = nr_cpus > 0 ? nr_cpus : 1;
+		if (nr_loops > SERVER_LOOPS_MAX)
+			nr_loops = SERVER_LOOPS_MAX;
+	}
+	if (nr_loops > SERVER_LOOPS_MAX)
+		return EINVAL;
+	server->nr_loops = nr_loops;
+	return 0;
+}
+
 static inline void signal_ignore(int signum) {};
 int
 server_init(struct server *server,
@@ -152,17 +617,35 @@ server_init(struct server *server,
 	if (flags & SERVER_TCPNODELAY)
 		err = socket_set_tcpnodelay(server->fd);
 	if (err) goto fail_socket;
+	server->flags = flags;
 
-	if (callbacks->log == NULL)
+	if (callbacks->log == NULL) {
 		server->callbacks.log = server_log_null;
-	else
+		server->log_level = -1;
+	} else {
 		server->callbacks.log = callbacks->log;
+	}
 	server->callbacks.accept = callbacks->accept;
-	if (callbacks->do_request == NULL) {
+	if (callbacks->framing.type != FRAMING_NONE) {
+		if (callbacks->do_frame == NULL) {
+			err = EINVAL;
+			goto fail_missing_callback;
+		}
+		/* empty frames would never consume the read buffer */
+		if (callbacks->framing.type == FRAMING_FIXED &&
+				callbacks->framing.size == 0) {
+			err = EINVAL;
+			goto fail_missing_callback;
+		}
+	} else if (callbacks->do_request == NULL &&
+			callbacks->do_request_chain == NULL) {
 		err = EINVAL;
 		goto fail_missing_callback;
 	}
 	server->callbacks.do_request = callbacks->do_request;
+	server->callbacks.do_request_chain = callbacks->do_request_chain;
+	server->callbacks.do_frame = callbacks->do_frame;
+	server->callbacks.framing = callbacks->framing;
 	server->callbacks.postlisten = callbacks->postlisten;
 	server->callbacks.stop = callbacks->stop;
 	server->prv = prv;
@@ -177,6 +660,7 @@ server_init(struct server *server,
 fail_missing_callback:
 fail_socket:
 	socket_close(server->fd);
+	server->fd = -1;
 	return err;
 }
 
@@ -201,9 +685,280 @@ server_listen_tcp(struct server *server, const void *conf_)
 	server->addr = malloc(sizeof(struct sockaddr_in));
 	if (server->addr == NULL) return errno;
 	memset(server->addr, 0, sizeof(struct sockaddr_in));
-	return socket_listen_tcp(server->fd,
+	if (server->nr_loops > 1) {
+		int err = socket_set_reuseport(server->fd);
+		if (err) return err;
+	}
+	int err = socket_listen_tcp(server->fd,
 			(struct sockaddr_in *) server->addr,
 			conf->ip, conf->port, conf->backlog);
+	if (err) return err;
+	/* the other loops must bind the port actually chosen for port 0 */
+	socklen_t addrlen = sizeof(struct sockaddr_in);
+	if (getsockname(server->fd, server->addr, &addrlen) == -1)
+		return errno;
+	return 0;
+}
+
+/** Open the listener of a loop other than loop 0.
+ * TCP loops bind their own SO_REUSEPORT socket to the server address and the
+ * kernel spreads the incoming connections over them. Unix loops share the
+ * server socket, which is then non-blocking so that the loops losing the race
+ * for a connection do not block in accept().
+ */
+static
+int
+server_loop_listen(struct server_loop *sloop, const void *conf)
+{
+	struct server *server = sloop->server;
+	int err;
+	if (server->type != SOCKET_TCP) {
+		sloop->fd = server->fd;
+		return socket_set_nonblocking(server->fd);
+	}
+	const struct socket_config_tcp *tcpcf = conf;
+	int fd = socket_tcp();
+	if (fd == -1)
+		return errno;
+	err = socket_init(fd);
+	if (err) goto fail;
+	err = socket_set_reuseport(fd);
+	if (err) goto fail;
+	err = socket_set_nonblocking(fd);
+	if (err) goto fail;
+	if (server->flags & SERVER_TCPNODELAY)
+		err = socket_set_tcpnodelay(fd);
+	if (err) goto fail;
+	err = socket_listen_addr(fd, server->addr,
+			sizeof(struct sockaddr_in), tcpcf->backlog);
+	if (err) goto fail;
+	sloop->fd = fd;
+	return 0;
+
+fail:
+	socket_close(fd);
+	return err;
+}
+
+/** Close every connection and free the resources of a stopped loop. */
+static
+void
+server_loop_destroy(struct server_loop *sloop)
+{
+	struct server *server = sloop->server;
+	uintptr_t fd;
+	if (server == NULL)
+		return ;
+	while (sloop->nr_clients) {
+		struct peer_client *client =
+			sloop->clients[sloop->nr_clients - 1];
+		ev_io_stop(sloop->loop, &client->watcher_read);
+		ev_io_stop(sloop->loop, &client->watcher_write);
+		socket_close(client->watcher_read.fd);
+		server_loop_del_client(sloop, client);
+		peer_client_free(client);
+	}
+	if (sloop->engine)
+		sloop->engine->destroy(sloop);
+	/* requests still in progress refer to the loop and their connection */
+	server_drain(server, &sloop->nr_inflight, "deferred requests");
+	server_loop_complete_requests(sloop);
+	struct mpsc_node *node;
+	while ((node = mpsc_queue_pop(&sloop->pushes)) != NULL)
+		free(container_of(node, struct server_push, node));
+	free(sloop->conns);
+	sloop->conns = NULL;
+	free(sloop->clients);
+	sloop->clients = NULL;
+	free(sloop->dirty.ids);
+	sloop->dirty.ids = NULL;
+	free(sloop->ready.ids);
+	sloop->ready.ids = NULL;
+	slab_cache_destroy(&sloop->client_slab);
+	while (sloop->nr_spare_buffers)
+		simple_buffer_free(
+			sloop->spare_buffers[--sloop->nr_spare_buffers]);
+	if (sloop->handoff.cells) {
+		/* connections handed to the loop after it stopped */
+		while (mpsc_ring_pop(&sloop->handoff, &fd) == 0) {
+			socket_close(fd);
+			__atomic_sub_fetch(&server->nr_clients, 1,
+					__ATOMIC_RELAXED);
+		}
+		mpsc_ring_destroy(&sloop->handoff);
+	}
+	free(sloop->handoff_addrs);
+	sloop->handoff_addrs = NULL;
+	if (sloop->loop == NULL)
+		return ;
+	ev_io_stop(sloop->loop, &sloop->watcher);
+	ev_async_stop(sloop->loop, &sloop->watcher_stop);
+	ev_async_stop(sloop->loop, &sloop->watcher_handoff);
+	ev_async_stop(sloop->loop, &sloop->watcher_complete);
+	ev_async_stop(sloop->loop, &sloop->watcher_push);
+	ev_timer_stop(sloop->loop, &sloop->watcher_timer);
+	ev_prepare_stop(sloop->loop, &sloop->watcher_flush);
+	ev_check_stop(sloop->loop, &sloop->watcher_ready);
+	ev_idle_stop(sloop->loop, &sloop->watcher_idle);
+	if (sloop->fd != -1 && sloop->fd != server->fd)
+		socket_close(sloop->fd);
+	if (!ev_is_default_loop(sloop->loop))
+		ev_loop_destroy(sloop->loop);
+}
+
+/** Initialize a loop.
+ * The acceptor, or loop 0 when there is no acceptor, runs the default loop
+ * and listens on the server socket. With an acceptor, the other loops get
+ * their connections from their handoff ring instead of a listener.
+ */
+static
+int
+server_loop_init(struct server_loop *sloop, struct server *server,
+		uint32_t id, const void *conf)
+{
+	const int acceptor = sloop == &server->acceptor;
+	int err;
+	sloop->server = server;
+	sloop->id = id;
+	sloop->fd = -1;
+	sloop->nr_clients = 0;
+	sloop->nr_spare_buffers = 0;
+	mpsc_queue_init(&sloop->completions);
+	sloop->nr_inflight = 0;
+	mpsc_queue_init(&sloop->pushes);
+	sloop->push_wakeup = 0;
+	sloop->conns = NULL;
+	sloop->max_conns = 0;
+	sloop->clients = NULL;
+	sloop->max_clients = 0;
+	memset(&sloop->dirty, 0, sizeof(sloop->dirty));
+	memset(&sloop->ready, 0, sizeof(sloop->ready));
+	sloop->engine = NULL;
+	sloop->engine_data = NULL;
+	sloop->handoff_addrs = NULL;
+	err = slab_cache_init(&sloop->client_slab, sizeof(struct peer_client),
+			server->accept_batch);
+	if (err) return err;
+	if (acceptor || (id == 0 && server->balance == NULL)) {
+		sloop->loop = ev_default_loop(0);
+		sloop->fd = server->fd;
+	} else {
+		sloop->loop = ev_loop_new(EVFLAG_AUTO);
+	}
+	if (sloop->loop == NULL)
+		return ENOMEM;
+	ev_async *watcher_stop = &sloop->watcher_stop;
+	ev_async_init(watcher_stop, server_callback_stop);
+	ev_async_start(sloop->loop, watcher_stop);
+	ev_async *watcher_complete = &sloop->watcher_complete;
+	ev_async_init(watcher_complete, server_callback_complete);
+	ev_async_start(sloop->loop, watcher_complete);
+	ev_async *watcher_push = &sloop->watcher_push;
+	ev_async_init(watcher_push, server_callback_push);
+	ev_async_start(sloop->loop, watcher_push);
+	sloop->wheel_epoch = ev_now(sloop->loop);
+	wheel_init(&sloop->wheel, 0);
+	ev_timer *watcher_timer = &sloop->watcher_timer;
+	ev_timer_init(watcher_timer, server_callback_timer,
+			SERVER_TIMER_TICK, SERVER_TIMER_TICK);
+	if (!acceptor && (server->timeouts[SERVER_TIMEOUT_IDLE] ||
+				server->timeouts[SERVER_TIMEOUT_READ] ||
+				server->timeouts[SERVER_TIMEOUT_WRITE]))
+		ev_timer_start(sloop->loop, watcher_timer);
+	ev_prepare *watcher_flush = &sloop->watcher_flush;
+	ev_prepare_init(watcher_flush, server_callback_flush);
+	if (!acceptor)
+		ev_prepare_start(sloop->loop, watcher_flush);
+	ev_check *watcher_ready = &sloop->watcher_ready;
+	ev_check_init(watcher_ready, server_callback_ready);
+	ev_idle *watcher_idle = &sloop->watcher_idle;
+	ev_idle_init(watcher_idle, server_callback_idle);
+	if (server_engines[server->engine] && !acceptor) {
+		const struct server_engine *engine =
+			server_engines[server->engine];
+		err = engine->init(sloop);
+		if (err)
+			LOG_SERVER(server, LOG_WARNING,
+				"loop %u falls back to libev, no %s: %s",
+				id, engine->name, strerror(err));
+		else
+			sloop->engine = engine;
+	}
+	if (server->balance && !acceptor) {
+		err = mpsc_ring_init(&sloop->handoff, SERVER_HANDOFF_QUEUE);
+		if (err) return err;
+		sloop->handoff_addrs = malloc(SERVER_HANDOFF_QUEUE *
+				sizeof(*sloop->handoff_addrs));
+		if (sloop->handoff_addrs == NULL)
+			return errno;
+		ev_async *watcher_handoff = &sloop->watcher_handoff;
+		ev_async_init(watcher_handoff, server_callback_handoff);
+		ev_async_start(sloop->loop, watcher_handoff);
+		return 0;
+	}
+	if (sloop->fd == -1) {
+		err = server_loop_listen(sloop, conf);
+		if (err) return err;
+	} else {
+		/* accepting in a row must stop on EAGAIN, not block */
+		err = socket_set_nonblocking(sloop->fd);
+		if (err) return err;
+	}
+	ev_io *watcher = &sloop->watcher;
+	ev_io_init(watcher, server_callback_accept, sloop->fd, EV_READ);
+	if (sloop->engine && sloop->engine->accept)
+		sloop->engine->accept(sloop);
+	else
+		ev_io_start(sloop->loop, watcher);
+	return 0;
+}
+
+static
+void
+server_loop_run(struct server_loop *sloop)
+{
+	_server_loop = sloop;
+	ev_loop(sloop->loop, 0);
+	_server_loop = NULL;
+}
+
+static
+void *
+server_loop_thread(void *sloop)
+{
+	server_loop_run(sloop);
+	return NULL;
+}
+
+/** Index of the first loop that runs in its own thread. */
+static inline
+uint32_t
+server_first_thread(struct server *server)
+{
+	return server->balance ? 0 : 1;
+}
+
+/** Stop and join the loop threads started below `nr_threads`, then release
+ * every loop.
+ */
+static
+void
+server_loops_free(struct server *server, uint32_t nr_threads)
+{
+	uint32_t i;
+	for (i = server_first_thread(server); i < nr_threads; i++) {
+		struct server_loop *sloop = &server->loops[i];
+		ev_async_send(sloop->loop, &sloop->watcher_stop);
+		pthread_join(sloop->thread, NULL);
+	}
+	__atomic_store_n(&server->nr_running, 0, __ATOMIC_SEQ_CST);
+	server_drain(server, &server->nr_senders, "server_send() calls");
+	server_loop_destroy(&server->acceptor);
+	memset(&server->acceptor, 0, sizeof(server->acceptor));
+	for (i = 0; i < server->nr_loops; i++)
+		server_loop_destroy(&server->loops[i]);
+	free(server->loops);
+	server->loops = NULL;
 }
 
 int
@@ -214,292 +969,2464 @@ server_listen(struct server *server, const void *conf)
 	networkserver_listen_t _listen = socket_type_ops[server->type].listen;
 	int err = _listen(server, conf);
 	if (err) return err;
+
+	uint32_t i, nr_threads = server_first_thread(server);
+	server->loops = calloc(server->nr_loops, sizeof(*server->loops));
+	if (server->loops == NULL)
+		return errno;
+	if (server->balance) {
+		err = server_loop_init(&server->acceptor, server,
+				server->nr_loops, conf);
+		if (err) {
+			LOG_SERVER(server, LOG_ERR,
+				"cannot start acceptor: %s", strerror(err));
+			goto fail_loops;
+		}
+	}
+	for (i = 0; i < server->nr_loops; i++) {
+		err = server_loop_init(&server->loops[i], server, i, conf);
+		if (err) {
+			LOG_SERVER(server, LOG_ERR,
+				"cannot start loop %u: %s", i, strerror(err));
+			goto fail_loops;
+		}
+	}
 	if (server->callbacks.postlisten)
 		server->callbacks.postlisten(server->prv);
+	__atomic_store_n(&server->nr_running, server->nr_loops,
+			__ATOMIC_RELEASE);
+
+	/* Signals are handled by the thread that called server_listen(). */
+	sigset_t sigset, sigsaved;
+	sigfillset(&sigset);
+	pthread_sigmask(SIG_BLOCK, &sigset, &sigsaved);
+	for (; nr_threads < server->nr_loops; nr_threads++) {
+		struct server_loop *sloop = &server->loops[nr_threads];
+		err = pthread_create(&sloop->thread, NULL,
+				server_loop_thread, sloop);
+		if (err) break;
+	}
+	pthread_sigmask(SIG_SETMASK, &sigsaved, NULL);
+	if (err) {
+		LOG_SERVER(server, LOG_ERR,
+			"cannot start loop thread: %s", strerror(err));
+		goto fail_loops;
+	}
 
-	struct ev_loop *loop = ev_default_loop(0);
-	struct ev_io *watcher = &server->watcher;
-	ev_io_init(watcher, server_callback_accept, server->fd, EV_READ);
-	ev_io_start(loop, &server->watcher);
-	ev_loop(loop, 0);
+	/* The acceptor, or loop 0, runs in the calling thread. */
+	struct server_loop *sloop = server->balance ?
+		&server->acceptor : &server->loops[0];
+	/* server_stop() may have run before nr_running was set */
+	if (__atomic_load_n(&server->stopping, __ATOMIC_ACQUIRE))
+		ev_async_send(sloop->loop, &sloop->watcher_stop);
+	server_loop_run(sloop);
+	server_loops_free(server, nr_threads);
+	if (server->callbacks.stop)
+		server->callbacks.stop(server->prv);
 
-	return 0;
+	return __atomic_load_n(&server->stop_err, __ATOMIC_ACQUIRE);
+
+fail_loops:
+	server_loops_free(server, nr_threads);
+	return err;
 }
 
 
 /* Private functions */
 
+/** Ask the loop to return from ev_loop(). Sent by server_stop(). */
 static
 void
-server_callback_disconnect(struct ev_loop *loop, ev_io *w, int revents)
+server_callback_stop(struct ev_loop *loop, ev_async *w, int revents)
 {
-	struct peer_client *client;
-	client = container_of(w, struct peer_client, watcher_read);
-	server_callback_write(loop, &client->watcher_write, revents);
-	ev_io_stop(loop, &client->watcher_read);
-	ev_io_stop(loop, &client->watcher_write);
-	socket_close(w->fd);
-	server_del_client(client->server, client);
-	peer_client_free(client);
+	struct server_loop *sloop =
+		container_of(w, struct server_loop, watcher_stop);
+	ev_io_stop(loop, &sloop->watcher);
+	ev_unloop(loop, EVUNLOOP_ALL);
 }
 
-/** Write response stored in client->buffer_write.
- * The event loop triggers this callback once the file descriptor is available
- * for writing. As the socket is configured in non-blocking mode, the event
- * loop may interrupt the write. It would lead to a partial write that we must
- * handle.
- * Each time the callback calls write(), it writes n bytes. Then the buffer
- * pointer is increment of n bytes. client->done_write is 0 until the buffer
- * pointer reaches the end of the buffer data.
- */
+/** Get a buffer from the spare pool of the loop, or allocate a new one. */
+static
+struct simple_buffer *
+server_loop_buffer_get(struct server_loop *sloop)
+{
+	struct server *server = sloop->server;
+	if (sloop->nr_spare_buffers)
+		return sloop->spare_buffers[--sloop->nr_spare_buffers];
+	struct simple_buffer *buf = simple_buffer_new(server->buffer_size);
+	if (buf == NULL) return NULL;
+	simple_buffer_set_flags(buf, SIMPLE_BUFFER_COMPACT);
+	simple_buffer_set_policy(buf, &server->buffer_policy);
+	return buf;
+}
+
+/** Give a buffer back to the spare pool, free it if the pool is full. */
 static
 void
-server_callback_write(struct ev_loop *loop, ev_io *w, int revents)
+server_loop_buffer_put(struct server_loop *sloop, struct simple_buffer *buf)
 {
-	struct peer_client *client =
-		container_of(w, struct peer_client, watcher_write);
-	unsigned int bufsz =
-		simple_buffer_size(client->buffer_write);
-	if (bufsz == 0) return ;
-	ssize_t n = write(w->fd,
-			simple_buffer_get_head(client->buffer_write),
-			bufsz);
-	if (n == -1) {
-		if (errno == EAGAIN)
-			return ;
-		LOG_SERVER(client->server, LOG_ERR,
-			"cannot write to socket (%s:%d): %d",
-			client->hostname, client->port, errno);
-		/* Handle error. Might disconnect */
-		simple_buffer_clear(client->buffer_write);
+	if (sloop->nr_spare_buffers == SERVER_SPARE_BUFFERS) {
+		simple_buffer_free(buf);
+		return ;
+	}
+	simple_buffer_clear(buf);
+	sloop->spare_buffers[sloop->nr_spare_buffers++] = buf;
+}
+
+/** Give back the buffers that do not hold any data.
+ * Partial requests and unsent responses keep their buffer until the next
+ * callback.
+ */
+static
+void
+peer_client_release_buffers(struct peer_client *client)
+{
+	struct server_loop *sloop = client->loop;
+	if (client->buffer_read &&
+			simple_buffer_size(client->buffer_read) == 0) {
+		server_loop_buffer_put(sloop, client->buffer_read);
+		client->buffer_read = NULL;
+	}
+	if (client->buffer_write &&
+			simple_buffer_size(client->buffer_write) == 0) {
+		server_loop_buffer_put(sloop, client->buffer_write);
+		client->buffer_write = NULL;
+	}
+	if (chain_buffer_size(&client->chain_write) == 0)
+		chain_buffer_clear(&client->chain_write);
+}
+
+static
+void
+server_callback_disconnect(struct ev_loop *loop, ev_io *w, int revents)
+{
+	struct peer_client *client;
+	client = container_of(w, struct peer_client, watcher_read);
+	server_callback_write(loop, &client->watcher_write, revents);
+	ev_io_stop(loop, &client->watcher_read);
+	ev_io_stop(loop, &client->watcher_write);
+	if (client->loop->engine && client->loop->engine->close)
+		client->loop->engine->close(client->loop, client);
+	socket_close(w->fd);
+	server_loop_del_client(client->loop, client);
+	peer_client_free(client);
+}
+
+static inline
+size_t
+peer_client_pending(struct peer_client *client)
+{
+	size_t size = chain_buffer_size(&client->chain_write);
+	if (client->buffer_write)
+		size += simple_buffer_size(client->buffer_write);
+	return size;
+}
+
+/* What a callback achieved, for peer_client_update_timeout(). */
+#define PROGRESS_READ	1 /* a request was handled */
+#define PROGRESS_WRITE	2 /* the socket took bytes */
+
+static inline
+uint32_t
+server_loop_tick(struct server_loop *sloop)
+{
+	return (ev_now(sloop->loop) - sloop->wheel_epoch) / SERVER_TIMER_TICK;
+}
+
+/** Arm the timeout that applies to the connection in its current state.
+ * Switching to another timeout arms it afresh. The read and write timeouts
+ * are only pushed back by `progress` in their direction, the idle timeout
+ * by any callback. Re-arming within the same tick leaves the wheel alone.
+ */
+static
+void
+peer_client_update_timeout(struct peer_client *client, int progress)
+{
+	struct server_loop *sloop = client->loop;
+	const uint32_t *timeouts = sloop->server->timeouts;
+	const ev_timer *watcher_timer = &sloop->watcher_timer;
+	int timeout;
+	if (!ev_is_active(watcher_timer))
+		return ;
+	if (peer_client_pending(client))
+		timeout = SERVER_TIMEOUT_WRITE;
+	else if (client->buffer_read && simple_buffer_size(client->buffer_read))
+		timeout = SERVER_TIMEOUT_READ;
+	else if (client->nr_inflight)
+		timeout = SERVER_TIMEOUT_NONE;
+	else
+		timeout = SERVER_TIMEOUT_IDLE;
+	if (timeout == client->timeout &&
+			wheel_timer_pending(&client->timer)) {
+		if (timeout == SERVER_TIMEOUT_READ &&
+				!(progress & PROGRESS_READ))
+			return ;
+		if (timeout == SERVER_TIMEOUT_WRITE &&
+				!(progress & PROGRESS_WRITE))
+			return ;
+	}
+	client->timeout = timeout;
+	if (timeouts[timeout] == 0) {
+		wheel_del(&sloop->wheel, &client->timer);
+		return ;
+	}
+	uint32_t expires = server_loop_tick(sloop) + timeouts[timeout] + 1;
+	if (wheel_timer_pending(&client->timer) &&
+			client->timer.expires == expires)
+		return ;
+	wheel_add(&sloop->wheel, &client->timer, expires);
+}
+
+/* Whether a connection is read and written. The libev engine tells it with
+ * its watchers, the other engines with the flags of its connection slot.
+ */
+
+static inline
+uint32_t *
+peer_client_flags(const struct peer_client *client)
+{
+	return &client->loop->conns[client->watcher_read.fd].flags;
+}
+
+/** @return 1 while the connection is read, 0 otherwise. */
+static inline
+int
+peer_client_reading(const struct peer_client *client)
+{
+	if (client->loop->engine)
+		return *peer_client_flags(client) & CONN_READ;
+	const ev_io *watcher_read = &client->watcher_read;
+	return ev_is_active(watcher_read);
+}
+
+/** @return 1 while a response waits to be written, 0 otherwise. */
+static inline
+int
+peer_client_writing(const struct peer_client *client)
+{
+	if (client->loop->engine)
+		return *peer_client_flags(client) & CONN_WRITE;
+	const ev_io *watcher_write = &client->watcher_write;
+	return ev_is_active(watcher_write);
+}
+
+static inline
+void
+peer_client_read_start(struct ev_loop *loop, struct peer_client *client)
+{
+	if (client->loop->engine)
+		client->loop->engine->read_start(client->loop, client);
+	else
+		ev_io_start(loop, &client->watcher_read);
+}
+
+static inline
+void
+peer_client_read_stop(struct ev_loop *loop, struct peer_client *client)
+{
+	if (client->loop->engine)
+		client->loop->engine->read_stop(client->loop, client);
+	else
+		ev_io_stop(loop, &client->watcher_read);
+}
+
+static inline
+void
+peer_client_write_start(struct ev_loop *loop, struct peer_client *client)
+{
+	if (client->loop->engine)
+		*peer_client_flags(client) |= CONN_WRITE;
+	else
+		ev_io_start(loop, &client->watcher_write);
+}
+
+static inline
+void
+peer_client_write_stop(struct ev_loop *loop, struct peer_client *client)
+{
+	if (client->loop->engine)
+		*peer_client_flags(client) &= ~CONN_WRITE;
+	else
 		ev_io_stop(loop, &client->watcher_write);
+}
+
+/** Count the bytes waiting to be sent to the connection in the total of the
+ * server, when it has a write budget.
+ * @return number of bytes waiting to be sent.
+ */
+static
+size_t
+peer_client_account_unsent(struct peer_client *client)
+{
+	struct server *server = client->loop->server;
+	size_t pending = peer_client_pending(client);
+	uint32_t unsent = pending > UINT32_MAX ? UINT32_MAX : pending;
+	if (server->write_budget && unsent != client->unsent) {
+		__atomic_add_fetch(&server->write_pending,
+			(size_t) unsent - client->unsent, __ATOMIC_RELAXED);
+		client->unsent = unsent;
+	}
+	return pending;
+}
+
+/** Stop reading from a connection whose responses pile up: above the high
+ * watermark, or above the low one while the server is over its write budget.
+ * Only a connection that is waiting for its socket is stopped, the write
+ * callback resumes it.
+ * @return 1 if the connection is no longer read, 0 otherwise.
+ */
+static
+int
+peer_client_throttle(struct ev_loop *loop, struct peer_client *client)
+{
+	struct server *server = client->loop->server;
+	if (server->write_high == 0 && server->write_budget == 0)
+		return 0;
+	size_t pending = peer_client_account_unsent(client);
+	if (pending <= server->write_low || !peer_client_writing(client))
+		return 0;
+	int over = server->write_high && pending > server->write_high;
+	if (!over && server->write_budget)
+		over = __atomic_load_n(&server->write_pending,
+				__ATOMIC_RELAXED) > server->write_budget;
+	if (!over)
+		return 0;
+	peer_client_read_stop(loop, client);
+	return 1;
+}
+
+/** Read again from a stopped connection once its responses drained down to
+ * the low watermark. The requests it already holds are processed in the next
+ * read callback, even if no more bytes arrive.
+ */
+static
+void
+peer_client_unthrottle(struct ev_loop *loop, struct peer_client *client)
+{
+	struct server *server = client->loop->server;
+	if (server->write_high == 0 && server->write_budget == 0)
+		return ;
+	if (peer_client_account_unsent(client) > server->write_low ||
+			peer_client_reading(client))
+		return ;
+	peer_client_read_start(loop, client);
+	if (client->buffer_read && simple_buffer_size(client->buffer_read))
+		ev_feed_event(loop, &client->watcher_read, EV_CUSTOM);
+}
+
+/** @return 0 on success, errno value on error. */
+static
+int
+server_conn_list_add(struct server_conn_list *list, server_conn_t id)
+{
+	if (list->nr == list->max) {
+		uint32_t max = list->max ? list->max * 2 : 64;
+		server_conn_t *ids = realloc(list->ids, max * sizeof(*ids));
+		if (ids == NULL)
+			return errno;
+		list->ids = ids;
+		list->max = max;
+	}
+	list->ids[list->nr++] = id;
+	return 0;
+}
+
+/** Arm `watcher_write` for a new response and list the connection for
+ * server_callback_flush(). A connection that is already waiting for its
+ * socket is left alone.
+ */
+static
+void
+peer_client_want_write(struct ev_loop *loop, struct peer_client *client)
+{
+	struct server_loop *sloop = client->loop;
+	if (peer_client_writing(client))
+		return ;
+	peer_client_write_start(loop, client);
+	/* on error, the socket is written once it is writable with libev,
+	 * right away with the other engines
+	 */
+	if (server_conn_list_add(&sloop->dirty, server_client_id(client)) &&
+			sloop->engine)
+		server_callback_write(loop, &client->watcher_write, EV_WRITE);
+}
+
+/** Gather the next part of the pending response: the bytes of
+ * `client->buffer_write`, then the memory segments of `client->chain_write`
+ * up to the first file segment.
+ * @param bufsz set to the number of bytes of `client->buffer_write` in `iov`.
+ * @return number of entries of `iov` filled, 0 if a file segment comes first.
+ */
+static
+int
+peer_client_write_iovec(struct peer_client *client,
+		struct iovec iov[CHAIN_IOV_BATCH], unsigned int *bufsz)
+{
+	int iovcnt = 0;
+	*bufsz = 0;
+	if (client->buffer_write)
+		*bufsz = simple_buffer_size(client->buffer_write);
+	if (*bufsz) {
+		iov[0].iov_base = simple_buffer_get_head(client->buffer_write);
+		iov[0].iov_len = *bufsz;
+		iovcnt++;
+	}
+	return iovcnt + chain_buffer_iovec(&client->chain_write, iov + iovcnt,
+			CHAIN_IOV_BATCH - iovcnt);
+}
+
+/** Drop the `n` bytes written out of peer_client_write_iovec(). */
+static
+void
+peer_client_write_done(struct peer_client *client, size_t n,
+		unsigned int bufsz)
+{
+	if (n > bufsz) {
+		if (bufsz)
+			simple_buffer_pull(client->buffer_write, bufsz);
+		chain_buffer_pull(&client->chain_write, n - bufsz);
+	} else {
+		simple_buffer_pull(client->buffer_write, n);
+	}
+}
+
+/** Write the next part of the pending response with a single system call.
+ * The bytes of `client->buffer_write`, then the memory segments of
+ * `client->chain_write` up to the first file segment, go out with writev().
+ * A file segment at the front of the chain goes out with sendfile().
+ * With server_set_cork(), memory segments that are not the end of the
+ * pending output go out with sendmsg() and MSG_MORE instead of writev().
+ * @param complete set to 1 when everything that was offered was written.
+ * @return number of bytes written, -1 on error (errno is set).
+ */
+static
+ssize_t
+peer_client_write_step(struct peer_client *client, int fd, int *complete)
+{
+	struct chain_buffer *chain = &client->chain_write;
+	struct iovec iov[CHAIN_IOV_BATCH];
+	size_t offered = 0;
+	unsigned int bufsz;
+	ssize_t n;
+	int i, iovcnt = peer_client_write_iovec(client, iov, &bufsz);
+
+	if (iovcnt == 0) {
+		offered = chain_segment_len(chain_segment_first(chain));
+		n = chain_buffer_sendfile(chain, fd);
+		*complete = n > 0 && (size_t) n == offered;
+		return n;
+	}
+	for (i = 0; i < iovcnt; i++)
+		offered += iov[i].iov_len;
+	if (client->loop->server->cork &&
+			offered < peer_client_pending(client)) {
+		struct msghdr msg = {.msg_iov = iov, .msg_iovlen = iovcnt};
+		n = sendmsg(fd, &msg, MSG_MORE);
+	} else {
+		n = writev(fd, iov, iovcnt);
+	}
+	if (n <= 0) {
+		*complete = 0;
+		return n;
+	}
+	peer_client_write_done(client, n, bufsz);
+	*complete = (size_t) n == offered;
+	return n;
+}
+
+/** Write response stored in client->buffer_write and client->chain_write.
+ * The event loop triggers this callback once the file descriptor is available
+ * for writing. As the socket is configured in non-blocking mode, the event
+ * loop may interrupt the write. It would lead to a partial write that we must
+ * handle.
+ * The bytes of `client->buffer_write` go first, then the segments of
+ * `client->chain_write`, in order, memory segments with writev() and file
+ * segments with sendfile(). The callback keeps writing as long as each call
+ * writes everything it was offered, so a response made of memory and file
+ * segments is flushed in a single wakeup when the socket allows it. A partial
+ * write or EAGAIN leaves the remaining bytes for the next wakeup.
+ * client->done_write is 0 until both buffers are empty.
+ * With the other engines, the engine waits for the socket to take the
+ * remaining bytes. With io_uring, a connection whose send is in progress is
+ * left to its completion.
+ */
+static
+void
+server_callback_write(struct ev_loop *loop, ev_io *w, int revents)
+{
+	struct peer_client *client =
+		container_of(w, struct peer_client, watcher_write);
+	int progress = 0;
+	if (client->loop->engine &&
+			*peer_client_flags(client) & CONN_URING_SENDING)
+		return ;
+	while (peer_client_pending(client)) {
+		int complete;
+		ssize_t n = peer_client_write_step(client, w->fd, &complete);
+		if (n == -1) {
+			if (errno == EAGAIN)
+				goto out;
+			LOG_SERVER(client->loop->server, LOG_ERR,
+				"cannot write to socket (%s): %d",
+				CLIENT_ADDR(client), errno);
+			/* Handle error. Might disconnect */
+			if (client->buffer_write)
+				simple_buffer_rewind(client->buffer_write);
+			chain_buffer_clear(&client->chain_write);
+			break;
+		}
+		if (n > 0)
+			progress = PROGRESS_WRITE;
+		if (!complete)
+			goto out;
+	}
+	peer_client_write_stop(loop, client);
+	peer_client_release_buffers(client);
+out:
+	if (client->loop->engine && peer_client_pending(client))
+		client->loop->engine->wait_write(client->loop, client);
+	peer_client_unthrottle(loop, client);
+	peer_client_update_timeout(client, progress);
+}
+
+static inline
+struct simple_buffer *
+peer_client_get_buffer_write(struct peer_client *client)
+{
+	if (client->buffer_write == NULL)
+		client->buffer_write = server_loop_buffer_get(client->loop);
+	return client->buffer_write;
+}
+
+static
+void
+server_request_free(struct server_loop *sloop, struct server_request *req)
+{
+	if (req->response)
+		server_loop_buffer_put(sloop, req->response);
+	free(req);
+}
+
+/** Append the response of a request to `client->buffer_write`.
+ * The response buffer is taken over when nothing is waiting to be sent.
+ * @return 0 on success, errno value on error.
+ */
+static
+int
+peer_client_append_response(struct peer_client *client,
+		struct server_request *req)
+{
+	struct simple_buffer *res = req->response;
+	if (res == NULL || simple_buffer_size(res) == 0)
+		return 0;
+	if (client->buffer_write &&
+			simple_buffer_size(client->buffer_write)) {
+		return simple_buffer_append(client->buffer_write,
+				simple_buffer_get_head(res),
+				simple_buffer_size(res));
+	}
+	if (client->buffer_write)
+		server_loop_buffer_put(client->loop, client->buffer_write);
+	client->buffer_write = res;
+	req->response = NULL;
+	return 0;
+}
+
+/** Queue the response of a request, then send every response whose turn
+ * has come.
+ * @return ECONNABORTED if the connection must be closed, 0 otherwise.
+ */
+static
+int
+peer_client_queue_response(struct ev_loop *loop, struct peer_client *client,
+		struct server_request *req)
+{
+	struct list_head *pos = client->requests.prev;
+	while (pos != &client->requests &&
+			(int32_t) (list_entry(pos, struct server_request,
+					list)->seq - req->seq) > 0)
+		pos = pos->prev;
+	list_add(&req->list, pos);
+
+	while (!list_empty(&client->requests)) {
+		req = list_first_entry(&client->requests,
+				struct server_request, list);
+		if (req->seq != client->seq_flush)
+			break;
+		list_del(&req->list);
+		client->seq_flush++;
+		int err = req->err;
+		if (err == 0)
+			err = peer_client_append_response(client, req);
+		server_request_free(client->loop, req);
+		if (err)
+			return ECONNABORTED;
+		peer_client_want_write(loop, client);
+	}
+	return 0;
+}
+
+/** Buffer to hand to a request handler.
+ * While earlier requests are in progress, the response is captured in a
+ * buffer of its own so that it can wait for its turn.
+ */
+static
+struct simple_buffer *
+peer_client_begin_request(struct peer_client *client)
+{
+	client->deferred = 0;
+	_server_client = client;
+	if (client->seq_next != client->seq_flush)
+		return server_loop_buffer_get(client->loop);
+	return peer_client_get_buffer_write(client);
+}
+
+/** Account for the request handled with `bufwrite`.
+ * @return the handler status, 0 if it deferred the request.
+ */
+static
+int
+peer_client_end_request(struct ev_loop *loop, struct peer_client *client,
+		struct simple_buffer *bufwrite, int err)
+{
+	_server_client = NULL;
+	if (bufwrite != client->buffer_write) {
+		if (client->deferred || simple_buffer_size(bufwrite) == 0) {
+			server_loop_buffer_put(client->loop, bufwrite);
+		} else {
+			struct server_request *req = malloc(sizeof(*req));
+			if (req == NULL) {
+				server_loop_buffer_put(client->loop, bufwrite);
+				return ECONNABORTED;
+			}
+			req->client = client;
+			req->loop = client->loop;
+			req->seq = client->seq_next++;
+			req->err = 0;
+			req->response = bufwrite;
+			if (peer_client_queue_response(loop, client, req))
+				return ECONNABORTED;
+		}
+	}
+	if (err == EINPROGRESS && client->deferred)
+		return 0;
+	return err;
+}
+
+static inline
+int
+peer_client_do_request(struct ev_loop *loop, struct peer_client *client)
+{
+	struct server *server = client->loop->server;
+	if (server->callbacks.do_request_chain)
+		return server->callbacks.do_request_chain(server->prv,
+				&client->chain_write,
+				client->buffer_read,
+				&client->done_read);
+	struct simple_buffer *bufwrite = peer_client_begin_request(client);
+	if (bufwrite == NULL)
+		return errno;
+	int err = server->callbacks.do_request(server->prv,
+			bufwrite,
+			client->buffer_read,
+			&client->done_read);
+	return peer_client_end_request(loop, client, bufwrite, err);
+}
+
+static inline
+uint32_t
+framing_get_u16(const unsigned char *p, int big_endian)
+{
+	if (big_endian)
+		return (uint32_t) p[0] << 8 | p[1];
+	return (uint32_t) p[1] << 8 | p[0];
+}
+
+static inline
+uint32_t
+framing_get_u32(const unsigned char *p, int big_endian)
+{
+	if (big_endian)
+		return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 |
+			(uint32_t) p[2] << 8 | p[3];
+	return (uint32_t) p[3] << 24 | (uint32_t) p[2] << 16 |
+		(uint32_t) p[1] << 8 | p[0];
+}
+
+/** Find the next complete frame at the head of `buf`.
+ * @param frame set to the first byte of the frame payload.
+ * @param len set to the length of the payload.
+ * @param consumed set to the number of bytes to pull once it is processed.
+ * @return 0 if a whole frame is buffered, EAGAIN if more bytes are needed,
+ * EMSGSIZE if the frame is larger than `framing->max_size`, or if it does
+ * not fit in a buffer along with its header.
+ */
+static
+int
+server_framing_next(const struct server_framing *framing,
+		struct simple_buffer *buf,
+		const char **frame, uint32_t *len, uint32_t *consumed)
+{
+	const unsigned char *head =
+		(const unsigned char *) simple_buffer_get_head(buf);
+	const uint32_t size = simple_buffer_size(buf);
+	uint32_t hdrlen = 0;
+	uint32_t framelen = 0;
+
+	switch (framing->type) {
+	case FRAMING_LENGTH_U16_BE:
+	case FRAMING_LENGTH_U16_LE:
+		hdrlen = 2;
+		if (size < hdrlen)
+			goto need_more;
+		framelen = framing_get_u16(head,
+				framing->type == FRAMING_LENGTH_U16_BE);
+		break;
+	case FRAMING_LENGTH_U32_BE:
+	case FRAMING_LENGTH_U32_LE:
+		hdrlen = 4;
+		if (size < hdrlen)
+			goto need_more;
+		framelen = framing_get_u32(head,
+				framing->type == FRAMING_LENGTH_U32_BE);
+		break;
+	case FRAMING_FIXED:
+		framelen = framing->size;
+		break;
+	case FRAMING_LINE: {
+		const char *eol = simple_buffer_find_byte(buf, '\n');
+		if (eol == NULL) {
+			if (framing->max_size && size > framing->max_size)
+				return EMSGSIZE;
+			return EAGAIN;
+		}
+		*frame = (const char *) head;
+		*consumed = eol - *frame + 1;
+		if (eol > *frame && eol[-1] == '\r')
+			eol--;
+		*len = eol - *frame;
+		if (framing->max_size && *len > framing->max_size)
+			return EMSGSIZE;
+		return 0;
+	}
+	default:
+		return EINVAL;
+	}
+	if (framing->max_size && framelen > framing->max_size)
+		return EMSGSIZE;
+	/* without a limit, the header and frame sizes must not wrap around */
+	if (framelen > UINT32_MAX - hdrlen)
+		return EMSGSIZE;
+	if (size - hdrlen < framelen)
+		goto need_more;
+	*frame = (const char *) head + hdrlen;
+	*len = framelen;
+	*consumed = hdrlen + framelen;
+	return 0;
+
+need_more:
+	simple_buffer_set_need(buf, hdrlen + framelen);
+	return EAGAIN;
+}
+
+/** Feed the buffered bytes to the request callback.
+ * With a framing decoder, `do_frame` is called once per complete frame and
+ * every complete frame in the buffer is processed in a row. Otherwise
+ * `do_request` is called until it asks for more bytes.
+ * Nothing is called while fewer bytes than requested with
+ * simple_buffer_set_need() are buffered.
+ * Processing stops when the connection gets throttled: the remaining
+ * requests are processed once the write callback resumes it. It also stops
+ * once `budget` requests were handled.
+ * @param progress PROGRESS_READ is or-ed in once a request was handled.
+ * @param budget decremented for each request handled.
+ * @return ECONNABORTED if the connection must be closed, 0 otherwise.
+ */
+static
+int
+peer_client_process(struct ev_loop *loop, struct peer_client *client,
+		int *progress, uint32_t *budget)
+{
+	struct server *server = client->loop->server;
+	struct simple_buffer *bufread = client->buffer_read;
+	int err;
+
+	if (simple_buffer_missing(bufread))
+		return 0;
+	if (server->callbacks.framing.type == FRAMING_NONE) {
+		for (;;) {
+			err = peer_client_do_request(loop, client);
+			if (err != EAGAIN)
+				*progress |= PROGRESS_READ;
+			if (client->done_read) {
+				peer_client_want_write(loop, client);
+				client->done_read = 0;
+			}
+			if (err == ECONNABORTED)
+				return err;
+			if (err == EAGAIN)
+				break;
+			if (peer_client_throttle(loop, client))
+				break;
+			if (--*budget == 0)
+				break;
+			if (simple_buffer_size(bufread) == 0)
+				break;
+			if (simple_buffer_missing(bufread))
+				break;
+			if (err) {
+				LOG_SERVER(server, LOG_ERR,
+					"error: %s\n", strerror(err));
+				break;
+			}
+		}
+		return 0;
+	}
+
+	while (simple_buffer_size(bufread) && !simple_buffer_missing(bufread)) {
+		const char *frame;
+		uint32_t len, consumed;
+		err = server_framing_next(&server->callbacks.framing, bufread,
+				&frame, &len, &consumed);
+		if (err == EAGAIN)
+			break;
+		if (err) {
+			LOG_SERVER(server, LOG_ERR,
+				"invalid frame (%s): %s",
+				CLIENT_ADDR(client), strerror(err));
+			return ECONNABORTED;
+		}
+		struct simple_buffer *bufwrite =
+			peer_client_begin_request(client);
+		if (bufwrite == NULL)
+			return ECONNABORTED;
+		err = server->callbacks.do_frame(server->prv,
+				bufwrite, frame, len,
+				&client->done_read);
+		err = peer_client_end_request(loop, client, bufwrite, err);
+		simple_buffer_pull(bufread, consumed);
+		*progress |= PROGRESS_READ;
+		if (client->done_read) {
+			peer_client_want_write(loop, client);
+			client->done_read = 0;
+		}
+		if (err == ECONNABORTED)
+			return err;
+		if (err) {
+			LOG_SERVER(server, LOG_ERR,
+				"error: %s\n", strerror(err));
+		}
+		if (peer_client_throttle(loop, client))
+			break;
+		if (--*budget == 0)
+			break;
+	}
+	return 0;
+}
+
+/** Do not wake up for fewer bytes than the request handler needs.
+ * SO_RCVLOWAT is only updated when the value changes.
+ */
+static
+void
+peer_client_update_rcvlowat(struct peer_client *client, int fd)
+{
+	unsigned int lowat = 1;
+	if (client->buffer_read)
+		lowat = simple_buffer_missing(client->buffer_read);
+	if (lowat > SERVER_RCVLOWAT_MAX)
+		lowat = SERVER_RCVLOWAT_MAX;
+	if (lowat == 0)
+		lowat = 1;
+	if (lowat == client->rcvlowat)
 		return ;
+	if (socket_set_rcvlowat(fd, lowat) == 0)
+		client->rcvlowat = lowat;
+}
+
+/** Give the connection its next turn from server_callback_ready(). */
+static
+void
+peer_client_defer_read(struct ev_loop *loop, struct peer_client *client)
+{
+	struct server_loop *sloop = client->loop;
+	/* on error, only its socket brings it back */
+	if (server_conn_list_add(&sloop->ready, server_client_id(client)))
+		return ;
+	const ev_check *watcher_ready = &sloop->watcher_ready;
+	if (!ev_is_active(watcher_ready)) {
+		ev_check_start(loop, &sloop->watcher_ready);
+		ev_idle_start(loop, &sloop->watcher_idle);
+	}
+}
+
+/** Read data from socket and process _synchronously_.
+ * As the socket is configured in non-blocking mode, a read may be interrupted.
+ * The callback will resume it later. We need to track the state of the buffer
+ * and data that was read from the socket.
+ * The read loop reads straight into the free space at the tail of
+ * `client->buffer_read`, which only grows once that space is exhausted.
+ * An idle connection owns no buffer: both are borrowed from the server spare
+ * pool when the callback starts and given back at the end unless they still
+ * hold a partial request or an unsent response.
+ * Then it calls client_callback_do_request(client) to process the request.
+ * If the request was full, the callback fills `client->buffer_write`, resets
+ * `client->buffer_read` and sets `client->done_read` to 1. Otherwise,
+ * `client->done_read` is still 0 and the runtime iterates again in the read loop.
+ * As the loop fills `client->buffer_read`, the client_callback_do_request()
+ * may find messages boundaries and finally fills the response buffer.
+ * The responses are written once the loop is done with the callbacks of
+ * this iteration, see server_callback_flush().
+ * With server_set_read_budget(), the read loop stops once the budget of the
+ * wakeup is spent and the connection waits for another turn.
+ * With the io_uring engine, the requests are mostly processed right in the
+ * buffers of the ring, see server_uring_process(). The bytes received while
+ * a partial request waits in `client->buffer_read` are appended to it
+ * instead: the ring feeds the callback with EV_CUSTOM and it only processes
+ * them.
+ * With the epoll engine, the socket is read until EAGAIN, as its next edge
+ * only comes with new bytes.
+ */
+static
+void
+server_callback_read(struct ev_loop *loop, ev_io *w, int revents)
+{
+	struct peer_client *client =
+		container_of(w, struct peer_client, watcher_read);
+	if (client->buffer_read == NULL) {
+		client->buffer_read = server_loop_buffer_get(client->loop);
+		if (client->buffer_read == NULL) {
+			LOG_SERVER(client->loop->server, LOG_ERR,
+				"buffer_new error (%s:%d %s)",
+				__FILE__, __LINE__, __func__);
+			goto disconnect;
+		}
+	}
+	struct simple_buffer *bufread = client->buffer_read;
+	struct server *server = client->loop->server;
+	uint32_t budget = server->read_budget_requests ?
+		server->read_budget_requests : UINT32_MAX;
+	size_t nr_read = 0;
+	int progress = 0;
+	/* resumed or given another turn: the requests it holds come first */
+	if (revents & EV_CUSTOM) {
+		if (peer_client_process(loop, client, &progress, &budget) ==
+				ECONNABORTED)
+			goto disconnect;
+	}
+	while (peer_client_reading(client)) {
+		if (budget == 0 || (server->read_budget_bytes &&
+				nr_read >= server->read_budget_bytes)) {
+			peer_client_defer_read(loop, client);
+			break;
+		}
+		if (client->loop->engine && client->loop->engine->read) {
+			if (client->loop->engine->read(client->loop, client))
+				break;
+			LOG_SERVER(client->loop->server, LOG_INFO,
+				"remote connection closed (%s)",
+				CLIENT_ADDR(client));
+			goto disconnect;
+		}
+		/* grow only once the tail room is exhausted */
+		size_t room = simple_buffer_tailroom(bufread);
+		char *tail = simple_buffer_reserve(bufread,
+				room ? room : bufread->chunk_size);
+		if (tail == NULL) {
+			LOG_SERVER(client->loop->server, LOG_ERR,
+				"cannot grow read buffer (%s): %d",
+				CLIENT_ADDR(client), errno);
+			goto disconnect;
+		}
+		/* the engine saw the socket run dry since its last edge */
+		if (client->loop->engine && !(client->ready & PEER_READABLE))
+			break;
+		ssize_t n = read(w->fd, tail, simple_buffer_tailroom(bufread));
+		if (n == -1) {
+			if (errno == EAGAIN) {
+				if (client->loop->engine)
+					client->ready &= ~PEER_READABLE;
+				break;
+			}
+			LOG_SERVER(client->loop->server, LOG_ERR,
+				"cannot read socket (%s): %d",
+				CLIENT_ADDR(client), errno);
+			/* XXX: Handle error */
+			goto disconnect;
+		}
+		if (n == 0) {
+			LOG_SERVER(client->loop->server, LOG_INFO,
+				"remote connection closed (%s)",
+				CLIENT_ADDR(client));
+			goto disconnect;
+		}
+		simple_buffer_commit(bufread, n);
+		nr_read += n;
+		if (peer_client_process(loop, client, &progress, &budget) ==
+				ECONNABORTED)
+			goto disconnect;
+		if (!peer_client_reading(client))
+			break;
+	}
+	peer_client_update_rcvlowat(client, w->fd);
+	peer_client_release_buffers(client);
+	peer_client_update_timeout(client, progress);
+
+	return ;
+
+disconnect:
+	server_callback_disconnect(loop, w, revents);
+}
+
+static
+struct peer_client *
+peer_client_new(struct server_loop *sloop)
+{
+	struct peer_client *client = slab_alloc(&sloop->client_slab);
+	if (client == NULL)
+		return NULL;
+	client->buffer_read = NULL;
+	client->rcvlowat = 1;
+	client->done_read = 0;
+	client->buffer_write = NULL;
+	chain_buffer_init(&client->chain_write, 4*getpagesize());
+	client->done_write = 0;
+	client->loop = sloop;
+	client->seq_next = 0;
+	client->seq_flush = 0;
+	client->nr_inflight = 0;
+	INIT_LIST_HEAD(&client->requests);
+	client->deferred = 0;
+	client->closed = 0;
+	client->timeout = SERVER_TIMEOUT_NONE;
+	client->ready = 0;
+	wheel_timer_init(&client->timer);
+	client->unsent = 0;
+	client->addr.sa.sa_family = AF_UNSPEC;
+
+	return client;
+}
+
+/** Free a closed connection.
+ * While requests are in progress, only its buffers are released: the
+ * connection is freed with the last completion.
+ */
+static
+void
+peer_client_free(struct peer_client *client)
+{
+	assert(client != NULL);
+	wheel_del(&client->loop->wheel, &client->timer);
+	if (client->buffer_read) {
+		if (simple_buffer_size(client->buffer_read)) {
+			LOG_SERVER(client->loop->server, LOG_WARNING,
+				"remaining data in read buffer (%s)",
+				CLIENT_ADDR(client));
+		}
+		server_loop_buffer_put(client->loop, client->buffer_read);
+		client->buffer_read = NULL;
+	}
+	if (client->buffer_write) {
+		if (simple_buffer_size(client->buffer_write)) {
+			LOG_SERVER(client->loop->server, LOG_WARNING,
+				"remaining unsent data in write buffer (%s)",
+				CLIENT_ADDR(client));
+		}
+		server_loop_buffer_put(client->loop, client->buffer_write);
+		client->buffer_write = NULL;
+	}
+	if (chain_buffer_size(&client->chain_write)) {
+		LOG_SERVER(client->loop->server, LOG_WARNING,
+			"remaining unsent data in write chain (%s)",
+			CLIENT_ADDR(client));
+	}
+	chain_buffer_clear(&client->chain_write);
+	peer_client_account_unsent(client);
+	while (!list_empty(&client->requests)) {
+		struct server_request *req = list_first_entry(
+				&client->requests, struct server_request, list);
+		list_del(&req->list);
+		server_request_free(client->loop, req);
+	}
+	if (client->nr_inflight) {
+		client->closed = 1;
+		return ;
+	}
+	slab_free(&client->loop->client_slab, client);
+}
+
+/** Register a connection in the connection table of the loop.
+ * Both tables only grow, doubling their size.
+ * @return 0 on success, errno value on error.
+ */
+static
+int
+server_loop_add_client(struct server_loop *sloop, struct peer_client *client,
+		int fd)
+{
+	if ((uint32_t) fd >= sloop->max_conns) {
+		uint32_t max = sloop->max_conns ? sloop->max_conns : 1024;
+		while (max <= (uint32_t) fd)
+			max *= 2;
+		struct server_conn_slot *conns =
+			realloc(sloop->conns, max * sizeof(*conns));
+		if (conns == NULL) return errno;
+		memset(conns + sloop->max_conns, 0,
+			(max - sloop->max_conns) * sizeof(*conns));
+		sloop->conns = conns;
+		sloop->max_conns = max;
+	}
+	if (sloop->nr_clients == sloop->max_clients) {
+		uint32_t max = sloop->max_clients ?
+			2 * sloop->max_clients : 1024;
+		struct peer_client **clients =
+			realloc(sloop->clients, max * sizeof(*clients));
+		if (clients == NULL) return errno;
+		sloop->clients = clients;
+		sloop->max_clients = max;
+	}
+	sloop->conns[fd].client = client;
+	sloop->conns[fd].flags = 0;
+	client->gen = sloop->conns[fd].gen;
+	client->slot = sloop->nr_clients;
+	sloop->clients[client->slot] = client;
+	/* read by the acceptor thread */
+	__atomic_store_n(&sloop->nr_clients, sloop->nr_clients + 1,
+			__ATOMIC_RELAXED);
+	return 0;
+}
+
+/** Remove a connection from the tables of the loop.
+ * The last connection of `clients` takes its place, and ids of the
+ * connection go stale.
+ */
+static
+void
+server_loop_del_client(struct server_loop *sloop, struct peer_client *client)
+{
+	struct server_conn_slot *conn = &sloop->conns[client->watcher_read.fd];
+	struct peer_client *last = sloop->clients[sloop->nr_clients - 1];
+	conn->client = NULL;
+	conn->gen = (conn->gen + 1) & SERVER_CONN_GEN_MASK;
+	last->slot = client->slot;
+	sloop->clients[last->slot] = last;
+	__atomic_store_n(&sloop->nr_clients, sloop->nr_clients - 1,
+			__ATOMIC_RELAXED);
+	__atomic_sub_fetch(&sloop->server->nr_clients, 1, __ATOMIC_RELAXED);
+}
+
+/** Set up a connection accepted for `sloop`.
+ * @param addr address of the peer, NULL to ask the socket.
+ */
+static
+void
+server_loop_add_connection(struct server_loop *sloop, int fd,
+		struct sockaddr *addr, socklen_t socklen)
+{
+	struct server *server = sloop->server;
+	struct peer_client *client = peer_client_new(sloop);
+	if (client == NULL) {
+		LOG_SERVER(server, LOG_ERR,
+			"peer_client_new error (%s:%d %s): %d",
+			__FILE__, __LINE__, __func__, errno);
+		__atomic_sub_fetch(&server->nr_clients, 1, __ATOMIC_RELAXED);
+		socket_close(fd);
+		return ;
+	}
+	if (addr == NULL) {
+		/* a Unix peer address is truncated, only its family is used */
+		socklen = sizeof(client->addr);
+		if (getpeername(fd, &client->addr.sa, &socklen) == -1)
+			client->addr.sa.sa_family = AF_UNSPEC;
+	} else {
+		if (socklen > sizeof(client->addr))
+			socklen = sizeof(client->addr);
+		memcpy(&client->addr, addr, socklen);
+	}
+	struct ev_io *watcher_read = &client->watcher_read;
+	ev_io_init(watcher_read, server_callback_read, fd, EV_READ);
+	/* Init-only watcher_write. It will be started when data are
+	 * available in client->buffer_write.
+	 */
+	struct ev_io *watcher_write = &client->watcher_write;
+	ev_io_init(watcher_write, server_callback_write, fd, EV_WRITE);
+	int err = server_loop_add_client(sloop, client, fd);
+	if (err) {
+		LOG_SERVER(server, LOG_ERR,
+			"cannot register connection (%s): %s",
+			CLIENT_ADDR(client), strerror(err));
+		peer_client_free(client);
+		__atomic_sub_fetch(&server->nr_clients, 1, __ATOMIC_RELAXED);
+		socket_close(fd);
+		return ;
+	}
+
+	if (sloop->engine) {
+		err = sloop->engine->add(sloop, client);
+		if (err) {
+			LOG_SERVER(server, LOG_ERR,
+				"cannot register connection (%s): %s",
+				CLIENT_ADDR(client), strerror(err));
+			server_loop_del_client(sloop, client);
+			peer_client_free(client);
+			socket_close(fd);
+			return ;
+		}
+	}
+
+	LOG_SERVER(server, LOG_INFO,
+		"connection from: %s\n", CLIENT_ADDR(client));
+	peer_client_read_start(sloop->loop, client);
+	peer_client_update_timeout(client, 0);
+	if (server->callbacks.accept)
+		server->callbacks.accept(server->prv, client, fd);
+}
+
+/** Queue an accepted connection for the loop picked by the balancer.
+ * @param addr address of the peer, NULL to let the loop ask the socket.
+ */
+static
+void
+server_handoff(struct server *server, int fd,
+		struct sockaddr *addr, socklen_t socklen)
+{
+	struct server_loop *sloop = server->balance(server);
+	uint32_t pos;
+	if (mpsc_ring_claim(&sloop->handoff, &pos)) {
+		LOG_SERVER(server, LOG_ERR,
+			"handoff queue of loop %u is full", sloop->id);
+		__atomic_sub_fetch(&server->nr_clients, 1, __ATOMIC_RELAXED);
+		socket_close(fd);
+		return ;
+	}
+	/* the address travels in the entry of the cell, which is ours until
+	 * it is published */
+	struct server_handoff *h =
+		&sloop->handoff_addrs[mpsc_ring_index(&sloop->handoff, pos)];
+	h->socklen = 0;
+	if (addr) {
+		h->socklen = socklen < sizeof(h->addr) ?
+			socklen : sizeof(h->addr);
+		memcpy(&h->addr, addr, h->socklen);
+	}
+	mpsc_ring_publish(&sloop->handoff, pos, fd);
+	ev_async_send(sloop->loop, &sloop->watcher_handoff);
+}
+
+/** Pick up the completed requests and queue their responses. */
+static
+void
+server_loop_complete_requests(struct server_loop *sloop)
+{
+	struct mpsc_node *node;
+	while ((node = mpsc_queue_pop(&sloop->completions)) != NULL) {
+		struct server_request *req =
+			container_of(node, struct server_request, node);
+		struct peer_client *client = req->client;
+		client->nr_inflight--;
+		if (client->closed) {
+			server_request_free(sloop, req);
+			if (client->nr_inflight == 0)
+				peer_client_free(client);
+			continue;
+		}
+		if (peer_client_queue_response(sloop->loop, client, req)) {
+			server_callback_disconnect(sloop->loop,
+					&client->watcher_read, 0);
+			continue;
+		}
+		peer_client_throttle(sloop->loop, client);
+		peer_client_update_timeout(client, 0);
+	}
+}
+
+static
+void
+server_callback_complete(struct ev_loop *loop, ev_async *w, int revents)
+{
+	server_loop_complete_requests(
+			container_of(w, struct server_loop, watcher_complete));
+}
+
+/** Connection designated by `id`, NULL if it was closed. */
+static inline
+struct peer_client *
+server_loop_find_client(struct server_loop *sloop, server_conn_t id)
+{
+	uint32_t fd = (uint32_t) id;
+	uint32_t gen = (id >> 32) & SERVER_CONN_GEN_MASK;
+	if (fd >= sloop->max_conns || sloop->conns[fd].gen != gen)
+		return NULL;
+	return sloop->conns[fd].client;
+}
+
+/** Write the responses produced during the loop iteration.
+ * Runs before the loop polls again, so that each connection gets a single
+ * writev() for the responses of its read, completion and push callbacks.
+ * The socket is almost always writable: `watcher_write` is only left armed
+ * when the kernel does not take every byte, and as it is started and
+ * stopped before the loop polls, libev does not call epoll_ctl(2) for it.
+ */
+static
+void
+server_callback_flush(struct ev_loop *loop, ev_prepare *w, int revents)
+{
+	struct server_loop *sloop =
+		container_of(w, struct server_loop, watcher_flush);
+	uint32_t i;
+	if (sloop->engine) {
+		sloop->engine->flush(sloop);
+		return ;
+	}
+	for (i = 0; i < sloop->dirty.nr; i++) {
+		struct peer_client *client =
+			server_loop_find_client(sloop, sloop->dirty.ids[i]);
+		if (client && peer_client_writing(client))
+			server_callback_write(loop, &client->watcher_write,
+					EV_WRITE);
+	}
+	sloop->dirty.nr = 0;
+}
+
+/** Give the connections that exhausted their read budget another turn.
+ * Runs right after the loop polled: libev invokes check watchers first, so
+ * a connection whose socket is also ready is only called back once, with
+ * EV_READ and EV_CUSTOM. EV_CUSTOM makes it handle the requests it already
+ * holds before reading.
+ */
+static
+void
+server_callback_ready(struct ev_loop *loop, ev_check *w, int revents)
+{
+	struct server_loop *sloop =
+		container_of(w, struct server_loop, watcher_ready);
+	uint32_t i, nr = sloop->ready.nr;
+	/* the callbacks run once this one returns and may list them again */
+	sloop->ready.nr = 0;
+	ev_check_stop(loop, &sloop->watcher_ready);
+	ev_idle_stop(loop, &sloop->watcher_idle);
+	for (i = 0; i < nr; i++) {
+		struct peer_client *client =
+			server_loop_find_client(sloop, sloop->ready.ids[i]);
+		if (client && peer_client_reading(client))
+			ev_feed_event(loop, &client->watcher_read, EV_CUSTOM);
+	}
+}
+
+/* Only keeps the loop from blocking while connections wait for a turn, or
+ * while an engine has callbacks to run. Stops once the loop had
+ * nothing else to do.
+ */
+static
+void
+server_callback_idle(struct ev_loop *loop, ev_idle *w, int revents)
+{
+	ev_idle_stop(loop, w);
+}
+
+/** Append every message queued by server_send() to its connection.
+ * Each connection with new bytes gets its watcher_write started once.
+ */
+static
+void
+server_callback_push(struct ev_loop *loop, ev_async *w, int revents)
+{
+	struct server_loop *sloop =
+		container_of(w, struct server_loop, watcher_push);
+	struct mpsc_node *node;
+	/* senders queuing from now on wake the loop up again */
+	__atomic_store_n(&sloop->push_wakeup, 0, __ATOMIC_SEQ_CST);
+	while ((node = mpsc_queue_pop(&sloop->pushes)) != NULL) {
+		struct server_push *push =
+			container_of(node, struct server_push, node);
+		struct peer_client *client =
+			server_loop_find_client(sloop, push->id);
+		int err = 0;
+		if (client == NULL)
+			goto next;
+		if (server_chain_mode(sloop->server))
+			err = chain_buffer_append(&client->chain_write,
+					push->data, push->len);
+		else if (peer_client_get_buffer_write(client) == NULL)
+			err = errno;
+		else
+			err = simple_buffer_append(client->buffer_write,
+					push->data, push->len);
+		if (err) {
+			LOG_SERVER(sloop->server, LOG_ERR,
+				"cannot queue pushed data (%s): %s",
+				CLIENT_ADDR(client), strerror(err));
+			goto next;
+		}
+		peer_client_want_write(loop, client);
+		peer_client_throttle(loop, client);
+		peer_client_update_timeout(client, 0);
+next:
+		free(push);
+	}
+}
+
+/** Advance the timing wheel and close the connections whose timeout expired,
+ * all of them in a row.
+ */
+static
+void
+server_callback_timer(struct ev_loop *loop, ev_timer *w, int revents)
+{
+	static const char *const names[SERVER_TIMEOUT_MAX] = {
+		[SERVER_TIMEOUT_IDLE] = "idle",
+		[SERVER_TIMEOUT_READ] = "read",
+		[SERVER_TIMEOUT_WRITE] = "write"
+	};
+	struct server_loop *sloop =
+		container_of(w, struct server_loop, watcher_timer);
+	LIST_HEAD(expired);
+	wheel_advance(&sloop->wheel, server_loop_tick(sloop), &expired);
+	while (!list_empty(&expired)) {
+		struct peer_client *client = list_entry(expired.next,
+				struct peer_client, timer.list);
+		list_del(&client->timer.list);
+		wheel_timer_init(&client->timer);
+		LOG_SERVER(sloop->server, LOG_INFO, "%s timeout (%s)",
+			names[client->timeout], CLIENT_ADDR(client));
+		server_callback_disconnect(loop, &client->watcher_read, 0);
+	}
+}
+
+/** Pick up the connections queued by the acceptor. */
+static
+void
+server_callback_handoff(struct ev_loop *loop, ev_async *w, int revents)
+{
+	struct server_loop *sloop =
+		container_of(w, struct server_loop, watcher_handoff);
+	uintptr_t fd;
+	uint32_t pos;
+	slab_cache_reserve(&sloop->client_slab, mpsc_ring_size(&sloop->handoff));
+	while (mpsc_ring_front(&sloop->handoff, &fd, &pos) == 0) {
+		struct server_handoff h = sloop->handoff_addrs[
+			mpsc_ring_index(&sloop->handoff, pos)];
+		/* the entry may be reused as soon as the cell is released */
+		mpsc_ring_consume(&sloop->handoff);
+		server_loop_add_connection(sloop, fd,
+			h.socklen ? &h.addr.sa : NULL, h.socklen);
+	}
+}
+
+/** Take over an accepted connection, unless the server is full.
+ * @param addr address of the peer, NULL to ask the socket.
+ */
+static
+void
+server_loop_accepted(struct server_loop *sloop, int fd,
+		struct sockaddr *addr, socklen_t socklen)
+{
+	struct server *server = sloop->server;
+	/* the limit is shared by every loop */
+	if (__atomic_add_fetch(&server->nr_clients, 1,
+				__ATOMIC_RELAXED) > server->max_clients) {
+		__atomic_sub_fetch(&server->nr_clients, 1, __ATOMIC_RELAXED);
+		socket_close(fd);
+		LOG_SERVER(server, LOG_ERR,
+			"max clients (%u) reached", server->max_clients);
+		return ;
+	}
+	if (server->balance)
+		server_handoff(server, fd, addr, socklen);
+	else
+		server_loop_add_connection(sloop, fd, addr, socklen);
+}
+
+/** Accept the pending connections, at most `server->accept_batch` of them.
+ * accept4() makes them non-blocking and close-on-exec in the same call.
+ */
+static
+void
+server_callback_accept(struct ev_loop *loop, ev_io *w, int revents)
+{
+	struct server_loop *sloop = container_of(w, struct server_loop, watcher);
+	struct server *server = sloop->server;
+	uint32_t i;
+	if (server->balance == NULL)
+		slab_cache_reserve(&sloop->client_slab, server->accept_batch);
+	for (i = 0; i < server->accept_batch; i++) {
+		struct sockaddr_storage addr;
+		socklen_t socklen = sizeof(addr);
+		int fd = accept4(w->fd, (struct sockaddr *) &addr, &socklen,
+				SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd == -1) {
+			/* the backlog is empty, or another loop took it */
+			if (errno == EAGAIN)
+				return ;
+			/* the peer gave up while it was in the backlog */
+			if (errno == ECONNABORTED || errno == EINTR)
+				continue;
+			LOG_SERVER(server, LOG_ERR, "accept failed: %d", errno);
+			return ;
+		}
+		server_loop_accepted(sloop, fd, (struct sockaddr *) &addr,
+				socklen);
+	}
+}
+
+/* io_uring engine */
+
+#ifdef URING_SUPPORTED
+
+/* Operation of a request of the ring, in the top byte of its user data. The
+ * other bytes are those of the connection id, but for a send, whose user
+ * data is its index in `sends`.
+ */
+enum {
+	URING_ACCEPT = 1,
+	URING_RECV,
+	URING_SEND,
+	URING_POLL,
+	URING_CANCEL
+};
+
+/* A send in flight. It takes the pending output of its connection over, so
+ * that the bytes its iovec points to stay put until it completes: the
+ * responses produced meanwhile go to new buffers, and closing the connection
+ * leaves them alone.
+ */
+struct server_uring_send {
+	struct msghdr msg;
+	struct iovec iov[CHAIN_IOV_BATCH];
+	server_conn_t id;
+	size_t	offered;
+	unsigned int bufsz; /* bytes of `buf` in iov */
+	struct simple_buffer *buf; /* buffer_write of the connection */
+	struct chain_buffer chain; /* chain_write of the connection */
+};
+
+/* The ring of a loop. libev polls its file descriptor, which is readable
+ * while completions wait in the CQ ring.
+ */
+struct server_uring {
+	struct uring ring;
+	struct server_loop *sloop;
+	ev_io	watcher;
+	struct uring_buf_ring bufs;
+	uint32_t nr_files; /* slots of the registered files table */
+	uint32_t nr_free; /* sends not in flight */
+	uint32_t free[SERVER_URING_SEND_BATCH]; /* their index in `sends` */
+	struct server_uring_send sends[SERVER_URING_SEND_BATCH];
+};
+
+static void server_callback_uring(struct ev_loop *, ev_io *, int);
+static int server_uring_send(struct server_loop *, struct peer_client *);
+
+static inline
+uint64_t
+server_uring_data(int op, const struct peer_client *client)
+{
+	return (uint64_t) op << 56 | (uint64_t) client->gen << 32 |
+		(uint32_t) client->watcher_read.fd;
+}
+
+/** @return a SQE to fill, NULL if the ring cannot take requests any more. */
+static
+struct io_uring_sqe *
+server_uring_sqe(struct server_loop *sloop)
+{
+	struct server_uring *uring = sloop->engine_data;
+	struct uring *ring = &uring->ring;
+	struct io_uring_sqe *sqe = uring_get_sqe(ring);
+	if (sqe)
+		return sqe;
+	/* the SQ ring is full, the pending SQEs go first */
+	int err = uring_submit(ring, 0);
+	if (err) {
+		LOG_SERVER(sloop->server, LOG_ERR,
+			"cannot submit to io_uring: %s", strerror(err));
+		return NULL;
+	}
+	return uring_get_sqe(ring);
+}
+
+static
+void
+server_uring_cancel(struct server_loop *sloop, uint64_t data)
+{
+	struct io_uring_sqe *sqe = server_uring_sqe(sloop);
+	if (sqe == NULL)
+		return ;
+	uring_prep_cancel(sqe, data);
+	uring_sqe_set_data(sqe, (uint64_t) URING_CANCEL << 56);
+}
+
+/** Wait for the next completion of the ring, which only runs the probe. */
+static
+struct io_uring_cqe *
+server_uring_probe_wait(struct uring *ring)
+{
+	struct io_uring_cqe *cqe;
+	int err;
+	while ((cqe = uring_peek_cqe(ring)) == NULL) {
+		err = uring_submit(ring, 1);
+		if (err && err != EINTR)
+			return NULL;
+	}
+	return cqe;
+}
+
+/** Receive a byte from a socket pair with a multishot recv. Kernels before
+ * Linux 6.0 know IORING_OP_RECV but reject IORING_RECV_MULTISHOT with
+ * EINVAL, or end the request with its first completion.
+ * @return 0 if multishot recv works, ENOSYS if it does not, errno value on
+ * error.
+ */
+static
+int
+server_uring_probe_recv(struct server_uring *uring)
+{
+	struct uring *ring = &uring->ring;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	uint32_t flags;
+	int32_t res;
+	int sv[2];
+	int err;
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+		return errno;
+	if (write(sv[1], "", 1) != 1) {
+		err = errno;
+		goto out;
+	}
+	sqe = uring_get_sqe(ring);
+	uring_prep_recv_multishot(sqe, sv[0], 0, uring->bufs.bgid);
+	uring_sqe_set_data(sqe, 0);
+	err = EIO;
+	if ((cqe = server_uring_probe_wait(ring)) == NULL)
+		goto out;
+	res = cqe->res;
+	flags = cqe->flags;
+	uring_cqe_seen(ring);
+	if (res == -EINVAL || (res >= 0 && !(flags & IORING_CQE_F_MORE)))
+		err = ENOSYS;
+	else if (res < 0)
+		err = -res;
+	else
+		err = 0;
+	/* the end of the stream ends the request */
+	close(sv[1]);
+	sv[1] = -1;
+	while (flags & IORING_CQE_F_MORE) {
+		if (flags & IORING_CQE_F_BUFFER)
+			uring_buf_put(&uring->bufs,
+					flags >> IORING_CQE_BUFFER_SHIFT);
+		if ((cqe = server_uring_probe_wait(ring)) == NULL) {
+			err = EIO;
+			break;
+		}
+		flags = cqe->flags;
+		uring_cqe_seen(ring);
+	}
+	if (flags & IORING_CQE_F_BUFFER)
+		uring_buf_put(&uring->bufs, flags >> IORING_CQE_BUFFER_SHIFT);
+	uring_buf_commit(&uring->bufs);
+out:
+	close(sv[0]);
+	if (sv[1] != -1)
+		close(sv[1]);
+	return err;
+}
+
+/** Give the sockets of the loop to a new ring.
+ * The kernel must know every operation of the engine, provided buffer
+ * rings and multishot recv. Registered files are optional: without them, or past the slots of
+ * the table, sockets are used by file descriptor.
+ * @return 0 on success, errno value on error.
+ */
+static
+int
+server_uring_init(struct server_loop *sloop)
+{
+	static const uint8_t ops[] = {
+		IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG,
+		IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL
+	};
+	struct server_uring *uring = malloc(sizeof(*uring));
+	struct rlimit limit;
+	unsigned int i;
+	int err;
+	if (uring == NULL)
+		return errno;
+	err = uring_init(&uring->ring, SERVER_URING_ENTRIES,
+			16 * SERVER_URING_ENTRIES);
+	if (err) goto fail;
+	for (i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+		if (!uring_probe(&uring->ring, ops[i])) {
+			err = ENOSYS;
+			goto fail_ring;
+		}
+	}
+	err = uring_buf_ring_init(&uring->ring, &uring->bufs,
+			SERVER_URING_BUFFERS, SERVER_URING_BUFFER_SIZE, 0);
+	if (err) goto fail_ring;
+	err = server_uring_probe_recv(uring);
+	if (err) goto fail_bufs;
+	uring->nr_files = 0;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+		uring->nr_files = limit.rlim_cur < SERVER_URING_FILES ?
+			limit.rlim_cur : SERVER_URING_FILES;
+		if (uring_register_files_sparse(&uring->ring, uring->nr_files))
+			uring->nr_files = 0;
 	}
-	if (n == 0) {
-		return ;
-		/* LOG partial write? */
+	uring->sloop = sloop;
+	uring->nr_free = SERVER_URING_SEND_BATCH;
+	for (i = 0; i < SERVER_URING_SEND_BATCH; i++) {
+		uring->free[i] = i;
+		uring->sends[i].buf = NULL;
+		/* it only takes the segments of connections over */
+		chain_buffer_init(&uring->sends[i].chain, 0);
 	}
-	simple_buffer_pull(client->buffer_write, n);
-	if (simple_buffer_size(client->buffer_write) == 0) {
-		simple_buffer_clear(client->buffer_write);
-		ev_io_stop(loop, &client->watcher_write);
+	ev_io *watcher = &uring->watcher;
+	ev_io_init(watcher, server_callback_uring, uring->ring.fd, EV_READ);
+	ev_io_start(sloop->loop, watcher);
+	sloop->engine_data = uring;
+	return 0;
+
+fail_bufs:
+	uring_destroy(&uring->ring);
+	uring_buf_ring_destroy(&uring->bufs);
+	free(uring);
+	return err;
+fail_ring:
+	uring_destroy(&uring->ring);
+fail:
+	free(uring);
+	return err;
+}
+
+/** Close the ring of a loop whose connections are all closed. */
+static
+void
+server_uring_destroy(struct server_loop *sloop)
+{
+	struct server_uring *uring = sloop->engine_data;
+	struct io_uring_cqe *cqe;
+	uint32_t i;
+	ev_io_stop(sloop->loop, &uring->watcher);
+	/* connections accepted after the loop stopped */
+	while ((cqe = uring_peek_cqe(&uring->ring)) != NULL) {
+		if (cqe->user_data >> 56 == URING_ACCEPT && cqe->res >= 0)
+			socket_close(cqe->res);
+		uring_cqe_seen(&uring->ring);
+	}
+	uring_destroy(&uring->ring);
+	uring_buf_ring_destroy(&uring->bufs);
+	/* the output of the sends still in flight */
+	for (i = 0; i < SERVER_URING_SEND_BATCH; i++) {
+		if (uring->sends[i].buf)
+			simple_buffer_free(uring->sends[i].buf);
+		chain_buffer_clear(&uring->sends[i].chain);
 	}
+	free(uring);
+	sloop->engine_data = NULL;
+}
 
-	return ;
+/** Accept connections on the listener of the loop until it is closed. */
+static
+void
+server_uring_accept(struct server_loop *sloop)
+{
+	struct io_uring_sqe *sqe = server_uring_sqe(sloop);
+	if (sqe == NULL)
+		return ;
+	uring_prep_accept_multishot(sqe, sloop->fd);
+	uring_sqe_set_data(sqe, (uint64_t) URING_ACCEPT << 56);
 }
 
-/** Read data from socket and process _synchronously_.
- * As the socket is configured in non-blocking mode, a read may be interrupted.
- * The callback will resume it later. We need to track the state of the buffer
- * and data that was read from the socket.
- * The read loop appends data to `client->buffer_read`. Then it calls
- * client_callback_do_request(client) to process the request.
- * If the request was full, the callback fills `client->buffer_write`, resets
- * `client->buffer_read` and sets `client->done_read` to 1. Otherwise,
- * `client->done_read` is still 0 and the runtime iterates again in the read loop.
- * As the loop fills `client->buffer_read`, the client_callback_do_request()
- * may find messages boundaries and finally fills the response buffer.
+/** Register the socket of a new connection with the ring. */
+static
+int
+server_uring_add(struct server_loop *sloop, struct peer_client *client)
+{
+	struct server_uring *uring = sloop->engine_data;
+	int fd = client->watcher_read.fd;
+	sloop->conns[fd].flags = 0;
+	if ((uint32_t) fd < uring->nr_files &&
+			uring_register_file(&uring->ring, fd, fd) == 0)
+		sloop->conns[fd].flags |= CONN_URING_FIXED;
+	return 0;
+}
+
+/** Cancel the requests of a connection about to be closed.
+ * Its socket leaves the registered files right away, as the table holds it
+ * open; the requests in progress hold it open until they are cancelled.
  */
 static
 void
-server_callback_read(struct ev_loop *loop, ev_io *w, int revents)
+server_uring_close(struct server_loop *sloop, struct peer_client *client)
 {
-	struct peer_client *client =
-		container_of(w, struct peer_client, watcher_read);
-	const unsigned int bufsz = client->buffer_read->chunk_size;
-	char buf[bufsz];
-	for (;;) {
-		ssize_t n = read(w->fd, buf, bufsz);
-		if (n == -1) {
-			if (errno == EAGAIN)
-				break;
-			LOG_SERVER(client->server, LOG_ERR,
-				"cannot read socket (%s:%d): %d",
-				client->hostname, client->port, errno);
-			/* XXX: Handle error */
-			goto disconnect;
-		}
-		if (n == 0) {
-			LOG_SERVER(client->server, LOG_INFO,
-				"remote connection closed (%s:%d)",
-				client->hostname, client->port);
-			goto disconnect;
-		}
-		simple_buffer_append(client->buffer_read, buf, n);
-		for (;;) {
-			int err = client->server->callbacks.do_request(
-					client->server->prv,
-					client->buffer_write,
-					client->buffer_read,
-					&client->done_read);
-			if (client->done_read) {
-				ev_io_start(loop, &client->watcher_write);
-				client->done_read = 0;
-			}
-			if (err == ECONNABORTED)
-				goto disconnect;
-			if (err == EAGAIN)
-				break;
-			if (simple_buffer_size(client->buffer_read) == 0)
-				break;
-			if (err) {
-				LOG_SERVER(client->server, LOG_ERR,
-					"error: %s\n", strerror(err));
-				break;
-			}
-		}
+	struct server_uring *uring = sloop->engine_data;
+	int fd = client->watcher_read.fd;
+	uint32_t flags = sloop->conns[fd].flags;
+	if (flags & CONN_URING_RECV)
+		server_uring_cancel(sloop, server_uring_data(URING_RECV, client));
+	if (flags & CONN_URING_POLL)
+		server_uring_cancel(sloop, server_uring_data(URING_POLL, client));
+	if (flags & CONN_URING_FIXED)
+		uring_register_file(&uring->ring, fd, -1);
+	sloop->conns[fd].flags = 0;
+}
+
+static
+void
+server_uring_recv(struct server_loop *sloop, struct peer_client *client)
+{
+	struct server_uring *uring = sloop->engine_data;
+	uint32_t *flags = peer_client_flags(client);
+	struct io_uring_sqe *sqe = server_uring_sqe(sloop);
+	if (sqe == NULL)
+		return ;
+	uring_prep_recv_multishot(sqe, client->watcher_read.fd,
+			*flags & CONN_URING_FIXED, uring->bufs.bgid);
+	uring_sqe_set_data(sqe, server_uring_data(URING_RECV, client));
+	*flags |= CONN_URING_RECV;
+}
+
+/** Keep a recv armed while the connection is read and its read buffer holds
+ * less than `buffer_size` bytes. Past that, the bytes wait in the socket
+ * until the requests are processed, as with the libev engine.
+ */
+static
+void
+server_uring_update_recv(struct server_loop *sloop, struct peer_client *client)
+{
+	uint32_t *flags = peer_client_flags(client);
+	size_t backlog = 0;
+	if (client->buffer_read)
+		backlog = simple_buffer_size(client->buffer_read);
+	if ((*flags & CONN_READ) && !(*flags & CONN_URING_EOF) &&
+			backlog < sloop->server->buffer_size) {
+		if (!(*flags & CONN_URING_RECV))
+			server_uring_recv(sloop, client);
+	} else if ((*flags & (CONN_URING_RECV | CONN_URING_CANCEL)) ==
+			CONN_URING_RECV) {
+		/* the bytes received until then are kept */
+		server_uring_cancel(sloop, server_uring_data(URING_RECV, client));
+		*flags |= CONN_URING_CANCEL;
 	}
+}
 
-	return ;
+/** Read the connection. Once the peer closed its side, the read callback is
+ * fed so that it sees it.
+ */
+static
+void
+server_uring_read_start(struct server_loop *sloop, struct peer_client *client)
+{
+	uint32_t *flags = peer_client_flags(client);
+	*flags |= CONN_READ;
+	if (*flags & CONN_URING_EOF)
+		ev_feed_event(sloop->loop, &client->watcher_read, EV_CUSTOM);
+	server_uring_update_recv(sloop, client);
+}
 
-disconnect:
-	server_callback_disconnect(loop, w, revents);
+static
+void
+server_uring_read_stop(struct server_loop *sloop, struct peer_client *client)
+{
+	*peer_client_flags(client) &= ~CONN_READ;
+	server_uring_update_recv(sloop, client);
 }
 
+/** Receive more once the bytes received so far are processed. */
 static
-int peer_client_set_addr(struct peer_client *client,
-		struct sockaddr *addr, socklen_t socklen)
+int
+server_uring_read(struct server_loop *sloop, struct peer_client *client)
 {
-	char port[NI_MAXSERV]; /* size = 32 */
-	int err = getnameinfo(addr, socklen,
-			client->hostname, NI_MAXHOST, port, NI_MAXSERV,
-			NI_NUMERICHOST | NI_NUMERICSERV);
-	if (err == -1) {
-		LOG_SERVER(client->server, LOG_ERR,
-			"getnameinfo failed: %d", errno);
-		return errno;
+	if (*peer_client_flags(client) & CONN_URING_EOF)
+		return 0;
+	server_uring_update_recv(sloop, client);
+	return EAGAIN;
+}
+
+/** Write the rest of the pending response once the socket is writable. */
+static
+void
+server_uring_wait_write(struct server_loop *sloop, struct peer_client *client)
+{
+	uint32_t *flags = peer_client_flags(client);
+	struct io_uring_sqe *sqe;
+	if (*flags & CONN_URING_POLL)
+		return ;
+	sqe = server_uring_sqe(sloop);
+	if (sqe == NULL)
+		return ;
+	uring_prep_poll(sqe, client->watcher_read.fd, *flags & CONN_URING_FIXED,
+			POLLOUT);
+	uring_sqe_set_data(sqe, server_uring_data(URING_POLL, client));
+	*flags |= CONN_URING_POLL;
+}
+
+static
+void
+server_uring_accepted(struct server_loop *sloop, int32_t res, uint32_t flags)
+{
+	if (res >= 0)
+		server_loop_accepted(sloop, res, NULL, 0);
+	/* the peer gave up while it was in the backlog */
+	else if (res != -ECONNABORTED && res != -EINTR && res != -ECANCELED)
+		LOG_SERVER(sloop->server, LOG_ERR, "accept failed: %d", -res);
+	if (!(flags & IORING_CQE_F_MORE) && res != -ECANCELED)
+		server_uring_accept(sloop);
+}
+
+/** Process the requests in the `len` bytes of a recv completion right in
+ * the provided buffer, when the connection is read and no partial request
+ * waits in its read buffer. Only the bytes of the request left partial, or
+ * left over by the read budget, are copied to the read buffer.
+ * @return 0 on success, ECONNABORTED if the connection must be closed,
+ * errno value if the read buffer cannot hold the rest.
+ */
+static
+int
+server_uring_process(struct server_loop *sloop, struct peer_client *client,
+		char *data, uint32_t len)
+{
+	struct server *server = sloop->server;
+	struct simple_buffer *bufread = client->buffer_read;
+	struct simple_buffer view;
+	uint32_t budget = server->read_budget_requests ?
+		server->read_budget_requests : UINT32_MAX;
+	int progress = 0;
+	int err;
+	simple_buffer_init_view(&view, data, len);
+	client->buffer_read = &view;
+	err = peer_client_process(sloop->loop, client, &progress, &budget);
+	client->buffer_read = bufread;
+	if (err)
+		return err;
+	if (simple_buffer_size(&view)) {
+		if (bufread == NULL)
+			bufread = server_loop_buffer_get(sloop);
+		if (bufread == NULL)
+			return errno;
+		client->buffer_read = bufread;
+		err = simple_buffer_append(bufread,
+				simple_buffer_get_head(&view),
+				simple_buffer_size(&view));
+		if (err)
+			return err;
+		simple_buffer_set_need(bufread, view.need);
+		bufread->userptr = bufread->head +
+			simple_buffer_size_from_userptr(&view);
+		if (budget == 0)
+			peer_client_defer_read(sloop->loop, client);
 	}
-	client->port = atoi(port);
+	peer_client_release_buffers(client);
+	peer_client_update_timeout(client, progress);
 	return 0;
 }
 
+/** Hand the bytes of a recv completion to the connection. They are
+ * processed in place by server_uring_process() when possible. Otherwise
+ * they are appended to its read buffer and its read callback is fed. The
+ * provided buffer goes back to the kernel with the next uring_buf_commit().
+ */
 static
-struct peer_client *
-peer_client_new(struct server *server)
+void
+server_uring_received(struct server_loop *sloop, uint64_t data, int32_t res,
+		uint32_t flags)
 {
-	struct peer_client *client = malloc(sizeof(*client));
-	if (client == NULL) {
-		return NULL;
+	struct server_uring *uring = sloop->engine_data;
+	struct uring_buf_ring *bufs = &uring->bufs;
+	struct peer_client *client = server_loop_find_client(sloop, data);
+	uint16_t bid = flags >> IORING_CQE_BUFFER_SHIFT;
+	int appended = 0;
+	int err = 0;
+	if (client && res > 0) {
+		if ((*peer_client_flags(client) & CONN_READ) &&
+				(client->buffer_read == NULL ||
+				 simple_buffer_size(client->buffer_read) == 0)) {
+			err = server_uring_process(sloop, client,
+					uring_buf(bufs, bid), res);
+		} else {
+			if (client->buffer_read == NULL)
+				client->buffer_read =
+					server_loop_buffer_get(sloop);
+			if (client->buffer_read == NULL)
+				err = errno;
+			else
+				err = simple_buffer_append(client->buffer_read,
+						uring_buf(bufs, bid), res);
+			appended = 1;
+		}
+	}
+	if (flags & IORING_CQE_F_BUFFER)
+		uring_buf_put(bufs, bid);
+	if (client == NULL)
+		return ;
+	uint32_t *state = peer_client_flags(client);
+	if (!(flags & IORING_CQE_F_MORE))
+		*state &= ~(CONN_URING_RECV | CONN_URING_CANCEL);
+	if (err == ECONNABORTED) {
+		server_callback_disconnect(sloop->loop, &client->watcher_read, 0);
+		return ;
+	}
+	if (err) {
+		LOG_SERVER(sloop->server, LOG_ERR,
+			"cannot grow read buffer (%s): %d",
+			CLIENT_ADDR(client), err);
+		server_callback_disconnect(sloop->loop, &client->watcher_read, 0);
+		return ;
 	}
+	if (res == 0) {
+		*state |= CONN_URING_EOF;
+	} else if (res < 0 && res != -ENOBUFS && res != -ECANCELED) {
+		LOG_SERVER(sloop->server, LOG_ERR,
+			"cannot read socket (%s): %d", CLIENT_ADDR(client), -res);
+		server_callback_disconnect(sloop->loop, &client->watcher_read, 0);
+		return ;
+	}
+	if ((*state & CONN_READ) && (res == 0 || appended))
+		ev_feed_event(sloop->loop, &client->watcher_read, EV_CUSTOM);
+	/* out of buffers, cancelled, or full */
+	server_uring_update_recv(sloop, client);
+}
+
+/** Give the pending output a send took over back to its connection, ahead
+ * of the responses produced meanwhile.
+ * @return 0 on success, errno value if they cannot be put together.
+ */
+static
+int
+server_uring_send_return(struct server_loop *sloop,
+		struct server_uring_send *send, struct peer_client *client)
+{
+	struct simple_buffer *buf = send->buf;
+	struct simple_buffer *later = client->buffer_write;
 	int err = 0;
-	client->buffer_read = simple_buffer_new(16*getpagesize());
-	if (client->buffer_read == NULL) {
-		err = errno;
-		LOG_SERVER(server, LOG_ERR,
-			"buffer_new error (%s:%d %s)",
-			__FILE__, __LINE__, __func__);
-		goto fail_buffer_read;
+	send->buf = NULL;
+	if (buf && simple_buffer_size(buf)) {
+		if (later && simple_buffer_size(later))
+			err = simple_buffer_append(buf,
+					simple_buffer_get_head(later),
+					simple_buffer_size(later));
+		if (err) {
+			server_loop_buffer_put(sloop, buf);
+		} else {
+			if (later)
+				server_loop_buffer_put(sloop, later);
+			client->buffer_write = buf;
+		}
+	} else if (buf) {
+		server_loop_buffer_put(sloop, buf);
 	}
-	client->done_read = 0;
-	client->buffer_write = simple_buffer_new(16*getpagesize());
-	if (client->buffer_write == NULL) {
-		err = errno;
-		LOG_SERVER(server, LOG_ERR,
-			"buffer_new error (%s:%d %s)",
-			__FILE__, __LINE__, __func__);
-		goto fail_buffer_write;
+	chain_buffer_splice(&send->chain, &client->chain_write);
+	chain_buffer_splice(&client->chain_write, &send->chain);
+	return err;
+}
+
+/** Send the pending output of `client`. A file segment at its front goes
+ * out with server_callback_write() instead, which also finishes the write
+ * once nothing is left.
+ */
+static
+void
+server_uring_write(struct server_loop *sloop, struct peer_client *client)
+{
+	if (peer_client_pending(client) && server_uring_send(sloop, client))
+		return ;
+	server_callback_write(sloop->loop, &client->watcher_write, EV_WRITE);
+}
+
+/** Account for the bytes a send wrote and put it back in the free sends.
+ * The rest of the output is sent right away if the socket took everything,
+ * once it is writable otherwise.
+ */
+static
+void
+server_uring_sent(struct server_loop *sloop, uint32_t index, int32_t res)
+{
+	struct server_uring *uring = sloop->engine_data;
+	struct server_uring_send *send = &uring->sends[index];
+	struct peer_client *client = server_loop_find_client(sloop, send->id);
+	size_t offered = send->offered;
+	int err = 0;
+	if (res == -EAGAIN)
+		res = 0;
+	if (res > 0) {
+		size_t n = res;
+		if (send->bufsz)
+			simple_buffer_pull(send->buf,
+				n < send->bufsz ? n : send->bufsz);
+		if (n > send->bufsz)
+			chain_buffer_pull(&send->chain, n - send->bufsz);
 	}
-	client->done_write = 0;
-	client->server = server;
-	INIT_LIST_HEAD(&client->list);
-	memset(client->hostname, 0, NI_MAXHOST);
-	client->port = -1;
+	if (client) {
+		*peer_client_flags(client) &= ~CONN_URING_SENDING;
+		err = server_uring_send_return(sloop, send, client);
+	}
+	/* the connection was closed meanwhile */
+	if (send->buf) {
+		server_loop_buffer_put(sloop, send->buf);
+		send->buf = NULL;
+	}
+	chain_buffer_clear(&send->chain);
+	uring->free[uring->nr_free++] = index;
+	if (client == NULL)
+		return ;
+	if (res < 0 || err) {
+		LOG_SERVER(sloop->server, LOG_ERR,
+			"cannot write to socket (%s): %d",
+			CLIENT_ADDR(client), res < 0 ? -res : err);
+		if (client->buffer_write)
+			simple_buffer_rewind(client->buffer_write);
+		chain_buffer_clear(&client->chain_write);
+	} else if (res > 0) {
+		peer_client_update_timeout(client, PROGRESS_WRITE);
+	}
+	if (res >= 0 && !err && (size_t) res < offered)
+		server_uring_wait_write(sloop, client);
+	else
+		server_uring_write(sloop, client);
+	peer_client_unthrottle(sloop->loop, client);
+}
 
-	return client;
-fail_buffer_write:
-	simple_buffer_free(client->buffer_read);
-fail_buffer_read:
-	free(client);
-	errno = err;
-	return NULL;
+static
+void
+server_uring_writable(struct server_loop *sloop, uint64_t data)
+{
+	struct peer_client *client = server_loop_find_client(sloop, data);
+	if (client == NULL)
+		return ;
+	uint32_t *flags = peer_client_flags(client);
+	*flags &= ~CONN_URING_POLL;
+	if (*flags & CONN_WRITE)
+		server_uring_write(sloop, client);
 }
 
+/** Handle every completion of the ring. */
 static
 void
-peer_client_free(struct peer_client *client)
+server_uring_reap(struct server_loop *sloop)
 {
-	assert(client != NULL);
-	if (client->buffer_read) {
-		if (simple_buffer_size(client->buffer_read)) {
-			LOG_SERVER(client->server, LOG_WARNING,
-				"remaining data in read buffer (%s:%d)",
-				client->hostname, client->port);
+	struct server_uring *uring = sloop->engine_data;
+	struct io_uring_cqe *cqe;
+	while ((cqe = uring_peek_cqe(&uring->ring)) != NULL) {
+		uint64_t data = cqe->user_data;
+		int32_t res = cqe->res;
+		uint32_t flags = cqe->flags;
+		uring_cqe_seen(&uring->ring);
+		switch (data >> 56) {
+		case URING_ACCEPT:
+			server_uring_accepted(sloop, res, flags);
+			break;
+		case URING_RECV:
+			server_uring_received(sloop, data, res, flags);
+			break;
+		case URING_SEND:
+			server_uring_sent(sloop, (uint32_t) data, res);
+			break;
+		case URING_POLL:
+			server_uring_writable(sloop, data);
+			break;
 		}
-		simple_buffer_free(client->buffer_read);
 	}
-	if (client->buffer_write) {
-		if (simple_buffer_size(client->buffer_write)) {
-			LOG_SERVER(client->server, LOG_WARNING,
-				"remaining unsent data in write buffer (%s:%d)",
-				client->hostname, client->port);
+	uring_buf_commit(&uring->bufs);
+}
+
+static
+void
+server_callback_uring(struct ev_loop *loop, ev_io *w, int revents)
+{
+	server_uring_reap(container_of(w, struct server_uring, watcher)->sloop);
+}
+
+/** Queue a send of the pending output of `client`, up to its first file
+ * segment. The send takes `client->buffer_write` and `client->chain_write`
+ * over until it completes.
+ * @return 1 if it was queued, 0 if a file segment comes first, or if no
+ * send or SQE is left.
+ */
+static
+int
+server_uring_send(struct server_loop *sloop, struct peer_client *client)
+{
+	struct server_uring *uring = sloop->engine_data;
+	struct server_uring_send *send;
+	uint32_t *flags = peer_client_flags(client);
+	uint32_t msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+	struct io_uring_sqe *sqe;
+	uint32_t index;
+	int i, iovcnt;
+	if (uring->nr_free == 0)
+		return 0;
+	index = uring->free[uring->nr_free - 1];
+	send = &uring->sends[index];
+	iovcnt = peer_client_write_iovec(client, send->iov, &send->bufsz);
+	if (iovcnt == 0)
+		return 0;
+	sqe = server_uring_sqe(sloop);
+	if (sqe == NULL)
+		return 0;
+	uring->nr_free--;
+	send->offered = 0;
+	for (i = 0; i < iovcnt; i++)
+		send->offered += send->iov[i].iov_len;
+	if (sloop->server->cork && send->offered < peer_client_pending(client))
+		msg_flags |= MSG_MORE;
+	memset(&send->msg, 0, sizeof(send->msg));
+	send->msg.msg_iov = send->iov;
+	send->msg.msg_iovlen = iovcnt;
+	send->id = server_client_id(client);
+	if (send->bufsz) {
+		send->buf = client->buffer_write;
+		client->buffer_write = NULL;
+	}
+	chain_buffer_splice(&send->chain, &client->chain_write);
+	uring_prep_sendmsg(sqe, client->watcher_read.fd,
+			*flags & CONN_URING_FIXED, &send->msg, msg_flags);
+	uring_sqe_set_data(sqe, (uint64_t) URING_SEND << 56 | index);
+	*flags |= CONN_URING_SENDING;
+	return 1;
+}
+
+/** Send the responses of the loop iteration in a single submission.
+ * A connection has a single send in flight, and the loop at most
+ * SERVER_URING_SEND_BATCH: the other connections stay listed until a send
+ * completes. Nothing waits for the sends. Sends are non-blocking, so the
+ * kernel mostly runs them within the submission and their completions are
+ * handled right away. The others are handled once the ring wakes the loop
+ * up.
+ */
+static
+void
+server_uring_flush(struct server_loop *sloop)
+{
+	struct server_uring *uring = sloop->engine_data;
+	uint32_t i, nr = 0;
+	for (i = 0; i < sloop->dirty.nr; i++) {
+		server_conn_t id = sloop->dirty.ids[i];
+		struct peer_client *client = server_loop_find_client(sloop, id);
+		if (client == NULL || !peer_client_writing(client) ||
+				*peer_client_flags(client) &
+				CONN_URING_SENDING)
+			continue;
+		if (uring->nr_free == 0) {
+			sloop->dirty.ids[nr++] = id;
+			continue;
 		}
-		simple_buffer_free(client->buffer_write);
+		server_uring_write(sloop, client);
+	}
+	sloop->dirty.nr = nr;
+	uring_submit(&uring->ring, 0);
+	server_uring_reap(sloop);
+	/* the completions may have fed callbacks, queued sends or freed
+	 * sends for the connections still listed
+	 */
+	if (ev_pending_count(sloop->loop) || uring_sq_pending(&uring->ring) ||
+			(sloop->dirty.nr && uring->nr_free))
+		ev_idle_start(sloop->loop, &sloop->watcher_idle);
+}
+
+static
+const struct server_engine server_engine_uring = {
+	.name = "io_uring",
+	.init = server_uring_init,
+	.destroy = server_uring_destroy,
+	.accept = server_uring_accept,
+	.add = server_uring_add,
+	.close = server_uring_close,
+	.read_start = server_uring_read_start,
+	.read_stop = server_uring_read_stop,
+	.read = server_uring_read,
+	.wait_write = server_uring_wait_write,
+	.flush = server_uring_flush
+};
+
+#endif
+
+/* epoll engine */
+
+/* The epoll set of a loop. libev polls its file descriptor, which is
+ * readable while events wait in the set. The listener, the timer and the
+ * wakeups of other threads stay with libev, which cannot hand them to an
+ * outer epoll_wait(2): the nested epoll_wait(2) is the price, once per loop
+ * iteration with events, shared by every event of the iteration.
+ */
+struct server_epoll {
+	int	fd;
+	struct server_loop *sloop;
+	ev_io	watcher;
+	uint32_t batch; /* events taken by the next epoll_wait() */
+	struct epoll_event events[SERVER_EPOLL_BATCH_MAX];
+};
+
+static void server_callback_epoll(struct ev_loop *, ev_io *, int);
+
+static
+int
+server_epoll_init(struct server_loop *sloop)
+{
+	struct server_epoll *epoll = malloc(sizeof(*epoll));
+	if (epoll == NULL)
+		return errno;
+	epoll->fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll->fd == -1) {
+		int err = errno;
+		free(epoll);
+		return err;
 	}
-	free(client);
+	epoll->sloop = sloop;
+	epoll->batch = SERVER_EPOLL_BATCH_MIN;
+	ev_io *watcher = &epoll->watcher;
+	ev_io_init(watcher, server_callback_epoll, epoll->fd, EV_READ);
+	ev_io_start(sloop->loop, watcher);
+	sloop->engine_data = epoll;
+	return 0;
+}
+
+static
+void
+server_epoll_destroy(struct server_loop *sloop)
+{
+	struct server_epoll *epoll = sloop->engine_data;
+	ev_io_stop(sloop->loop, &epoll->watcher);
+	close(epoll->fd);
+	free(epoll);
+	sloop->engine_data = NULL;
+}
+
+/** Add the socket of a new connection to the set, for good: reading and
+ * writing are started and stopped by the loop alone, and closing the socket
+ * takes it out of the set. A new socket takes bytes.
+ */
+static
+int
+server_epoll_add(struct server_loop *sloop, struct peer_client *client)
+{
+	struct server_epoll *epoll = sloop->engine_data;
+	struct epoll_event event = {
+		.events = EPOLLIN | EPOLLOUT | EPOLLET,
+		.data.u64 = server_client_id(client)
+	};
+	if (epoll_ctl(epoll->fd, EPOLL_CTL_ADD, client->watcher_read.fd,
+				&event) == -1)
+		return errno;
+	client->ready = PEER_WRITABLE;
+	return 0;
+}
+
+/** Read the connection. A socket that became readable while it was not read
+ * has no edge to come: the read callback is fed instead.
+ */
+static
+void
+server_epoll_read_start(struct server_loop *sloop, struct peer_client *client)
+{
+	uint32_t *flags = peer_client_flags(client);
+	*flags |= CONN_READ;
+	if (client->ready & PEER_READABLE)
+		ev_feed_event(sloop->loop, &client->watcher_read, EV_READ);
 }
 
 static
 void
-server_add_client(struct server *server, struct peer_client *client)
+server_epoll_read_stop(struct server_loop *sloop, struct peer_client *client)
 {
-	list_add(&client->list, &server->clients);
-	server->nr_clients++;
+	*peer_client_flags(client) &= ~CONN_READ;
 }
 
+/** The socket did not take every byte: the next EPOLLOUT edge tells when it
+ * takes more.
+ */
 static
 void
-server_del_client(struct server *server, struct peer_client *client)
+server_epoll_wait_write(struct server_loop *sloop, struct peer_client *client)
 {
-	list_del(&client->list);
-	server->nr_clients--;
+	client->ready &= ~PEER_WRITABLE;
 }
 
+/** Write the responses of the loop iteration to the sockets that take them.
+ * The others are written on their next EPOLLOUT edge.
+ */
 static
 void
-server_callback_accept(struct ev_loop *loop, ev_io *w, int revents)
+server_epoll_flush(struct server_loop *sloop)
 {
-	struct server *server = (struct server *) w;
-	socklen_t socklen = sizeof(server->addr);
-	int fd = accept(server->fd, server->addr, &socklen);
-	if (fd == -1) {
-		LOG_SERVER(server, LOG_ERR, "accept failed: %d", errno);
-		return ;
+	uint32_t i;
+	for (i = 0; i < sloop->dirty.nr; i++) {
+		struct peer_client *client =
+			server_loop_find_client(sloop, sloop->dirty.ids[i]);
+		if (client && (*peer_client_flags(client) & CONN_WRITE) &&
+				(client->ready & PEER_WRITABLE))
+			server_callback_write(sloop->loop,
+					&client->watcher_write, EV_WRITE);
 	}
-	socket_set_nonblocking(fd);
+	sloop->dirty.nr = 0;
+	/* the writes may have resumed reading connections */
+	if (ev_pending_count(sloop->loop))
+		ev_idle_start(sloop->loop, &sloop->watcher_idle);
+}
 
-	if (server->nr_clients == server->max_clients) {
-		socket_close(fd);
-		LOG_SERVER(server, LOG_ERR,
-			"max clients (%u) reached", server->max_clients);
+/** Handle a batch of events of the set. An edge marks the socket readable
+ * or writable until a read or a write says otherwise, and calls the
+ * connection back if it is read or has a response to write.
+ * The batch doubles while the set fills it and halves while it stays mostly
+ * empty: a loop with few busy connections does not scan a large array, and
+ * a loaded one takes its events in few calls. The events left in the set
+ * keep its descriptor readable for the next iteration.
+ */
+static
+void
+server_callback_epoll(struct ev_loop *loop, ev_io *w, int revents)
+{
+	struct server_epoll *epoll =
+		container_of(w, struct server_epoll, watcher);
+	struct server_loop *sloop = epoll->sloop;
+	int i, n = epoll_wait(epoll->fd, epoll->events, epoll->batch, 0);
+	if (n == -1) {
+		if (errno != EINTR)
+			LOG_SERVER(sloop->server, LOG_ERR,
+				"epoll_wait failed: %d", errno);
 		return ;
 	}
-
-	struct peer_client *client = peer_client_new(server);
-	if (client == NULL) {
-		LOG_SERVER(server, LOG_ERR,
-			"peer_client_new error (%s:%d %s): %d",
-			__FILE__, __LINE__, __func__, errno);
-		socket_close(fd);
+	if ((uint32_t) n == epoll->batch &&
+			epoll->batch < SERVER_EPOLL_BATCH_MAX)
+		epoll->batch *= 2;
+	else if ((uint32_t) n < epoll->batch / 4 &&
+			epoll->batch > SERVER_EPOLL_BATCH_MIN)
+		epoll->batch /= 2;
+	for (i = 0; i < n; i++) {
+		uint32_t events = epoll->events[i].events;
+		/* NULL if an earlier event of the batch closed it */
+		struct peer_client *client = server_loop_find_client(sloop,
+				epoll->events[i].data.u64);
+		if (client == NULL)
+			continue;
+		uint32_t *flags = peer_client_flags(client);
+		if (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+			client->ready |= PEER_WRITABLE;
+			if (*flags & CONN_WRITE)
+				server_callback_write(loop,
+					&client->watcher_write, EV_WRITE);
+		}
+		if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+			client->ready |= PEER_READABLE;
+			if (*flags & CONN_READ)
+				server_callback_read(loop,
+					&client->watcher_read, EV_READ);
+		}
 	}
-	peer_client_set_addr(client, server->addr, socklen);
-	server_add_client(server, client);
-
-	LOG_SERVER(server, LOG_INFO,
-		"connection from: %s:%d\n", client->hostname, client->port);
-	struct ev_io *watcher_read = &client->watcher_read;
-	ev_io_init(watcher_read, server_callback_read, fd, EV_READ);
-	ev_io_start(loop, &client->watcher_read);
-
-	/* Init-only watcher_write. It will be started when data are
-	 * available in client->buffer_write.
-	 */
-	struct ev_io *watcher_write = &client->watcher_write;
-	ev_io_init(watcher_write, server_callback_write, fd, EV_WRITE);
-	if (server->callbacks.accept)
-		server->callbacks.accept(server->prv, client, fd);
-	return ;
 }
 
+static
+const struct server_engine server_engine_epoll = {
+	.name = "epoll",
+	.init = server_epoll_init,
+	.destroy = server_epoll_destroy,
+	.add = server_epoll_add,
+	.read_start = server_epoll_read_start,
+	.read_stop = server_epoll_read_stop,
+	.wait_write = server_epoll_wait_write,
+	.flush = server_epoll_flush
+};
 
 /* vim: ts=8:sw=8:noet
 */
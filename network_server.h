@@ -17,21 +17,27 @@
 #define SIMPLE_NETWORK_SERVER_H_ 1
 
 #include <fcntl.h>
+#include <pthread.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
-#ifndef __USE_MISC
-# define __USE_MISC
-#endif
-#include <netdb.h>
 
 #include <ev.h>
 
 #include "network_list.h"
 #include "network_buffer.h"
+#include "network_chain.h"
+#include "network_queue.h"
+#include "network_slab.h"
+#include "network_wheel.h"
 #include "network_socket.h"
 
-#define LOG_SERVER(server, prio, fmt, args...) \
-	(server)->callbacks.log(prio, fmt, ##args);
+/* Arguments are only evaluated when `prio` is enabled (see
+ * server_set_log_level()).
+ */
+#define LOG_SERVER(server, prio, fmt, args...) do { \
+	if ((prio) <= (server)->log_level) \
+		(server)->callbacks.log(prio, fmt, ##args); \
+} while (0)
 
 static inline void server_log_null(int prio, const char *fmt, ...) {};
 
@@ -40,17 +46,144 @@ typedef enum {
 	SERVER_TCPNODELAY = TCP_NODELAY	
 } server_flags_t;
 
+/* Largest SO_RCVLOWAT set from a simple_buffer_set_need() hint. */
+#define SERVER_RCVLOWAT_MAX	(64*1024)
+
+/* Number of empty buffers each loop keeps for its connections. */
+#define SERVER_SPARE_BUFFERS	8
+
+/* Largest number of event loops a server may run. */
+#define SERVER_LOOPS_MAX	256
+
+/* Default number of connections accepted in a row by a listener wakeup. */
+#define SERVER_ACCEPT_BATCH	64
+
+/* Number of accepted connections that may wait for a loop. Power of 2. */
+#define SERVER_HANDOFF_QUEUE	1024
+
+/* io_uring engine of a loop, see server_set_engine(): number of SQEs, of
+ * receive buffers and their size, and of sends in flight.
+ */
+#define SERVER_URING_ENTRIES	256
+#define SERVER_URING_BUFFERS	256
+#define SERVER_URING_BUFFER_SIZE	(8*1024)
+#define SERVER_URING_SEND_BATCH	64
+
+/* Largest number of connections a loop registers with its ring, see
+ * server_set_engine(). The others are used by file descriptor.
+ */
+#define SERVER_URING_FILES	65536
+
+/* Events taken by an epoll_wait(2) of the epoll engine of a loop. The batch
+ * grows while the waits fill it and shrinks when they leave most of it.
+ */
+#define SERVER_EPOLL_BATCH_MIN	16
+#define SERVER_EPOLL_BATCH_MAX	1024
+
+/* Length of a timing wheel tick, in seconds. */
+#define SERVER_TIMER_TICK	0.1
+
+/* Timeouts of a connection, see server_set_timeouts(). */
+enum {
+	SERVER_TIMEOUT_NONE = 0,
+	SERVER_TIMEOUT_IDLE,
+	SERVER_TIMEOUT_READ,
+	SERVER_TIMEOUT_WRITE,
+	SERVER_TIMEOUT_MAX
+};
+
+/* Size of a buffer holding any address formatted by peer_client_addr(). */
+#define SERVER_ADDRSTRLEN	(INET6_ADDRSTRLEN + 8)
+
+/* `buffer_read` and `buffer_write` are NULL while the connection is idle.
+ * They are borrowed from the spare pool of `loop` during a callback and only
+ * kept when a partial request or an unsent response must survive it.
+ * Requests get a sequence number while earlier ones are in progress (see
+ * server_request_defer()). Their responses wait in `requests`, sorted by
+ * sequence, until every earlier response was appended to `buffer_write`.
+ * A connection closed while `nr_inflight` requests are in progress is only
+ * freed once they completed.
+ * The peer address is kept in binary form, see peer_client_addr(). Unix
+ * peer addresses are only kept for their family.
+ * `timer` holds the deadline of the timeout that currently applies to the
+ * connection, `timeout` tells which one (see server_set_timeouts()).
+ * Connections are allocated from the slab cache of their loop, on a cache
+ * line boundary. The fields used by the read and write callbacks come first
+ * and fill the first three cache lines with libev's 48 byte ev_io. The
+ * timer, only re-armed when timeouts are set, starts the fourth line, the
+ * fields only used when connecting or closing end it.
+ */
 struct peer_client {
-	ev_io   watcher_read;
-	ev_io	watcher_write;
-	struct server *server;
-	struct list_head list;
-        char    hostname[NI_MAXHOST]; /* NI_MAXHOST = 1025 */
-        int     port;
+	/* hot: read and write callbacks */
+	ev_io	watcher_read;
 	struct simple_buffer	*buffer_read;
 	struct simple_buffer	*buffer_write;
+	ev_io	watcher_write;
+	struct server_loop *loop;
+	int	rcvlowat;
 	int	done_read;
-	int	done_write;
+	uint32_t seq_next;
+	uint32_t seq_flush;
+	uint32_t nr_inflight;
+	uint8_t	done_write;
+	uint8_t	deferred;
+	uint8_t	closed;
+	uint8_t	timeout;
+	uint8_t	ready; /* readiness of the socket seen by the engine */
+	struct chain_buffer	chain_write;
+	struct list_head requests;
+	struct wheel_timer timer;
+	uint32_t unsent; /* bytes counted in `server->write_pending` */
+	/* cold */
+	uint32_t slot; /* index in `loop->clients` */
+	uint32_t gen;
+	union {
+		struct sockaddr		sa;
+		struct sockaddr_in	in;
+		struct sockaddr_in6	in6;
+	} addr;
+};
+
+/* Identifier of a connection that other threads may keep.
+ * Bits 56-63 hold the loop, bits 32-55 the generation of the file descriptor
+ * and bits 0-31 the file descriptor: an id outlives its connection without
+ * ever designating the next connection that gets the same file descriptor.
+ */
+typedef uint64_t server_conn_t;
+
+#define SERVER_CONN_GEN_MASK	0xffffff
+
+/* Entry of the connection table of a loop, indexed by file descriptor.
+ * `gen` is bumped every time the connection on that descriptor is closed.
+ * `flags` is the state of the connection in the I/O engine of the loop.
+ */
+struct server_conn_slot {
+	struct peer_client *client;
+	uint32_t gen;
+	uint32_t flags;
+};
+
+/* Connections a loop must get back to before it polls again. A connection
+ * closed in the meantime is skipped as its id no longer matches.
+ */
+struct server_conn_list {
+	server_conn_t *ids;
+	uint32_t nr;
+	uint32_t max;
+};
+
+/* A request whose response is produced later, possibly by another thread.
+ * `data` is free for the handler.
+ */
+struct server_request {
+	struct mpsc_node node;
+	struct list_head list;
+	struct peer_client *client;
+	struct server_loop *loop;
+	uint32_t seq;
+	int	err;
+	struct simple_buffer *response;
+	void	*data;
 };
 
 typedef void (*callback_log_t)(int priority, const char *fmt, ...);
@@ -63,27 +196,175 @@ typedef int (*callback_request_t)(
 		struct simple_buffer *bufwrite,
 		struct simple_buffer *bufread,
 		int *done);
+typedef int (*callback_request_chain_t)(
+		void *prv,
+		struct chain_buffer *chainwrite,
+		struct simple_buffer *bufread,
+		int *done);
+typedef int (*callback_frame_t)(
+		void *prv,
+		struct simple_buffer *bufwrite,
+		const char *frame,
+		uint32_t len,
+		int *done);
 typedef int (*callback_postlisten_t)(void *prv);
 typedef int (*callback_stop_t)(void *prv);
 
+/* I/O engine of the loops, see server_set_engine(). */
+typedef enum {
+	SERVER_ENGINE_LIBEV = 0,
+	SERVER_ENGINE_URING,
+	SERVER_ENGINE_EPOLL
+} server_engine_t;
+
+typedef enum {
+	FRAMING_NONE = 0,
+	FRAMING_LENGTH_U16_BE,
+	FRAMING_LENGTH_U16_LE,
+	FRAMING_LENGTH_U32_BE,
+	FRAMING_LENGTH_U32_LE,
+	FRAMING_LINE,
+	FRAMING_FIXED
+} framing_type_t;
+
+/* Built-in framing decoder.
+ * FRAMING_LENGTH_*: a 2 or 4 bytes length header followed by the payload;
+ *                   the header is not part of the frame.
+ * FRAMING_LINE:     frames end with '\n'; the delimiter and a preceding '\r'
+ *                   are not part of the frame.
+ * FRAMING_FIXED:    frames of `size` bytes, which must not be 0.
+ * A frame (or an unterminated line) larger than `max_size` closes the
+ * connection. 0 means no limit.
+ */
+struct server_framing {
+	framing_type_t	type;
+	uint32_t	size;
+	uint32_t	max_size;
+};
+
 struct server_callbacks {
 	callback_log_t		log;
 	callback_accept_t	accept;
 	callback_request_t	do_request;
 	callback_postlisten_t	postlisten;
 	callback_stop_t		stop;
+	/* members added after the first release come last */
+	callback_request_chain_t do_request_chain;
+	callback_frame_t	do_frame;
+	struct server_framing	framing;
+};
+
+/* An event loop and the connections it serves.
+ * Every loop has its own listener: a SO_REUSEPORT socket for TCP servers,
+ * the shared server socket for Unix servers. A connection stays on the loop
+ * that accepted it, so its callbacks always run on the same thread.
+ * Loop 0 is the libev default loop and runs in the thread that called
+ * server_listen(), the others run in their own thread.
+ * With an acceptor (see server_set_balancer()), the loops have no listener:
+ * the acceptor queues the connections in their `handoff` ring, wakes them up
+ * with `watcher_handoff` and every loop runs in its own thread.
+ * The connections of a loop are found by file descriptor in `conns` and
+ * packed in `clients`, `nr_clients` of them in no particular order. A
+ * callback running on the loop may walk `clients` to reach every connection
+ * of the loop, as long as it does not close any on the way.
+ * Connection timeouts live in `wheel`, whose tick `watcher_timer` advances
+ * every SERVER_TIMER_TICK seconds, counted from `wheel_epoch`.
+ * With another I/O engine than libev, `engine` does the I/O of the
+ * connections and `engine_data` holds its state. Both are NULL with libev.
+ */
+struct server_engine;
+
+/* Peer address of a connection in the `handoff` ring of a loop, as
+ * accept4() returned it, so that the loop needs no getpeername(2).
+ * A Unix peer address is truncated, only its family is used.
+ */
+struct server_handoff {
+	socklen_t socklen; /* 0 when the address is unknown */
+	union {
+		struct sockaddr		sa;
+		struct sockaddr_in	in;
+		struct sockaddr_in6	in6;
+	} addr;
 };
 
+struct server_loop {
+	ev_io	watcher;
+	ev_async watcher_stop;
+	ev_async watcher_handoff;
+	struct mpsc_ring handoff;
+	struct server_handoff *handoff_addrs; /* by mpsc_ring_index() */
+	ev_async watcher_complete;
+	struct mpsc_queue completions;
+	uint32_t nr_inflight;
+	ev_async watcher_push;
+	struct mpsc_queue pushes;
+	int	push_wakeup;
+	struct server_conn_slot *conns; /* indexed by file descriptor */
+	uint32_t max_conns;
+	struct peer_client **clients;
+	uint32_t max_clients;
+	struct ev_loop *loop;
+	struct server *server;
+	uint32_t id;
+	int	fd;
+	pthread_t thread;
+	uint32_t nr_clients;
+	uint32_t nr_spare_buffers;
+	struct simple_buffer *spare_buffers[SERVER_SPARE_BUFFERS];
+	struct slab_cache client_slab;
+	ev_timer watcher_timer;
+	ev_tstamp wheel_epoch;
+	struct timing_wheel wheel;
+	ev_prepare watcher_flush;
+	struct server_conn_list dirty; /* responses to flush */
+	ev_check watcher_ready;
+	ev_idle	watcher_idle;
+	struct server_conn_list ready; /* read budget exhausted */
+	const struct server_engine *engine;
+	void	*engine_data;
+};
+
+/** Choose the loop that serves the next accepted connection.
+ * Called by the acceptor thread only.
+ */
+typedef struct server_loop *(*server_balance_t)(struct server *server);
+
 struct server {
-        ev_io   watcher;
 	socket_type_t type;
         int     fd;
-        struct list_head clients;
-        uint32_t nr_clients;
+        uint32_t nr_clients; /* total over every loop */
 	uint32_t max_clients;
         void *addr;
 	struct server_callbacks callbacks;
 	void *prv;
+	server_flags_t flags;
+	int	log_level;
+	uint32_t buffer_size;
+	struct simple_buffer_policy buffer_policy;
+	uint32_t accept_batch;
+	uint32_t timeouts[SERVER_TIMEOUT_MAX]; /* in ticks, 0 if disabled */
+	size_t	write_high;
+	size_t	write_low;
+	size_t	write_budget;
+	size_t	write_pending; /* total over every loop, with a write budget */
+	int	cork;
+	size_t	read_budget_bytes;
+	uint32_t read_budget_requests;
+	server_engine_t engine;
+	uint32_t nr_loops;
+	struct server_loop *loops;
+	server_balance_t balance;
+	struct server_loop acceptor;
+	uint32_t balance_next;
+	unsigned int balance_seed;
+	uint32_t nr_running;
+	uint32_t nr_senders;
+	/* signalled when nr_senders or the nr_inflight of a loop drops to 0,
+	 * which they do under drain_lock */
+	pthread_mutex_t drain_lock;
+	pthread_cond_t drain_cond;
+	int	stopping;
+	int	stop_err;
 };
 
 /** Allocate and initialize a new server.
@@ -105,30 +386,280 @@ struct server *server_new(socket_type_t type, uint32_t max_clients);
 void server_free(struct server *server);
 
 /** Initialize the file descriptor of a server.
+ * A request handler that cannot make progress yet may return EAGAIN after
+ * calling simple_buffer_set_need(bufread, n): it is not called again until n
+ * bytes are buffered and SO_RCVLOWAT keeps the loop from waking up earlier.
+ * One of `callbacks->do_request` or `callbacks->do_request_chain` must be set.
+ * The latter queues the response in a chain of segments that is flushed with
+ * writev(2), so a handler may append a header and a body (possibly by
+ * reference with chain_buffer_append_ref()) without concatenating them.
+ * When both are set, `do_request_chain` is used.
+ * Alternatively, `callbacks->framing` selects a built-in decoder and
+ * `callbacks->do_frame` is then called exactly once per complete frame, with
+ * a pointer to the frame in the read buffer that is only valid during the
+ * call.
+ * With several loops (see server_set_loops()), callbacks run concurrently on
+ * the loop threads; server_current_loop() tells which loop is calling.
+ * `do_request` and `do_frame` may also return EINPROGRESS after calling
+ * server_request_defer(), and produce the response later from any thread.
+ * Responses are always sent in the order of the requests.
  * @param server pointer to the server to initialize.
  * @param flags flags to set (see definition of server_flags_t).
- * @return 0 on success, errno value on error.
+ * @return 0 on success, EINVAL for missing callbacks or FRAMING_FIXED with
+ * a `size` of 0, errno value on other errors.
  */
 int server_init(struct server *server,
 		struct server_callbacks *callbacks, void *prv, server_flags_t flags);
 
+/** Set the growth and retention policy of connection buffers.
+ * Must be called before server_listen().
+ * @param server pointer to the server.
+ * @param policy policy copied to every buffer the server allocates.
+ * @return 0 on success, EINVAL if the growth factor is below 100.
+ */
+int server_set_buffer_policy(struct server *server,
+		const struct simple_buffer_policy *policy);
+
+/** Set how many connections a listener wakeup may accept.
+ * The listener accepts until the backlog is empty or `batch` connections
+ * were accepted, and the state of that many connections is allocated
+ * beforehand, so a connection storm drains the backlog in few wakeups.
+ * The default is SERVER_ACCEPT_BATCH.
+ * @param server pointer to the server.
+ * @param batch maximum number of connections accepted per wakeup.
+ * @return 0 on success, EINVAL if batch is 0.
+ */
+int server_set_accept_batch(struct server *server, uint32_t batch);
+
+/** Set the least important priority passed to `callbacks->log`.
+ * Messages of a lower priority are dropped before their arguments are even
+ * formatted. The default is LOG_DEBUG, everything.
+ * @param server pointer to the server.
+ * @param level one of the syslog(3) LOG_* priorities, -1 to log nothing.
+ * @return 0.
+ */
+int server_set_log_level(struct server *server, int level);
+
+/** Close the connections that stop making progress.
+ * A connection is subject to a single timeout at a time:
+ * - `write` while a response is waiting to be sent: seconds without a byte
+ *   taken by the socket.
+ * - `read` while a partial request is buffered: seconds to receive the rest
+ *   of it, counted from the read that left it incomplete. Further reads do
+ *   not extend it.
+ * - `idle` otherwise: seconds without any byte read or written.
+ * None applies while deferred requests are in progress and nothing is
+ * buffered. Timeouts are checked every SERVER_TIMER_TICK seconds and the
+ * expired connections of a loop are closed in a row.
+ * Must be called before server_listen().
+ * @param server pointer to the server.
+ * @param idle, read, write timeouts in seconds, 0 to disable.
+ * @return 0 on success, EINVAL if a timeout is negative.
+ */
+int server_set_timeouts(struct server *server, double idle, double read,
+		double write);
+
+/** Stop reading from the connections that do not read their responses.
+ * Once more than `high` bytes wait to be sent to a connection, its requests
+ * are no longer read. Reading resumes when the socket took enough of them to
+ * leave `low` bytes or fewer. While stopped, the write timeout applies.
+ * Must be called before server_listen().
+ * @param server pointer to the server.
+ * @param high, low watermarks in bytes, 0 for both to disable.
+ * @return 0 on success, EINVAL if low is above high.
+ */
+int server_set_write_watermarks(struct server *server, size_t high,
+		size_t low);
+
+/** Bound the memory held by the responses waiting to be sent.
+ * While more than `budget` bytes wait over every connection, a connection
+ * stops being read as soon as more than the low watermark waits to be sent
+ * to it, and resumes as described in server_set_write_watermarks().
+ * Must be called before server_listen().
+ * @param server pointer to the server.
+ * @param budget in bytes, 0 to disable.
+ * @return 0.
+ */
+int server_set_write_budget(struct server *server, size_t budget);
+
+/** Tell the kernel that more of a response follows.
+ * A response that does not go out in a single system call, such as a header
+ * followed by a file segment or a chain longer than CHAIN_IOV_BATCH
+ * segments, is written with MSG_MORE until its last part, so that TCP does
+ * not send its first part in a frame of its own. The default is off.
+ * @param server pointer to the server.
+ * @param cork 1 to enable, 0 to disable.
+ * @return 0.
+ */
+int server_set_cork(struct server *server, int cork);
+
+/** Share each loop fairly between its connections.
+ * A read wakeup of a connection stops after `bytes` bytes were read or
+ * `requests` requests were handled. The connection then waits for its next
+ * turn: the connections that exhausted their budget get another one, in
+ * turn, after the loop has polled the other sockets, so that a client
+ * streaming requests does not hold up the others. The default is no budget.
+ * Must be called before server_listen().
+ * @param server pointer to the server.
+ * @param bytes bytes read per wakeup, 0 for no limit.
+ * @param requests requests handled per wakeup, 0 for no limit.
+ * @return 0.
+ */
+int server_set_read_budget(struct server *server, size_t bytes,
+		uint32_t requests);
+
+/** Choose how the loops do their I/O.
+ * SERVER_ENGINE_LIBEV, the default, waits for readiness with libev and reads
+ * and writes with system calls. SERVER_ENGINE_URING gives the sockets of
+ * each loop to an io_uring ring: connections are accepted and read by
+ * multishot requests into buffers provided to the kernel, and the responses
+ * of a loop iteration go out as a single batch of sends. Sockets are
+ * registered with the ring, up to SERVER_URING_FILES of them per loop. The
+ * requests are processed right in those buffers, so the read buffer a
+ * request callback gets may be a SIMPLE_BUFFER_VIEW that cannot grow; only
+ * a partial request is copied to a buffer of the connection. A connection
+ * stops receiving while a read buffer worth of bytes waits to be processed.
+ * A loop whose kernel lacks io_uring support (Linux 6.0 or later) falls back
+ * to libev, which server_loop_engine() tells.
+ * SERVER_ENGINE_EPOLL gives the sockets of each loop to an edge-triggered
+ * epoll set: a connection is registered once for reading and writing and
+ * its readiness is tracked by the loop, so that starting and stopping to
+ * read or write never costs a system call. libev still runs the listener
+ * and the timers, and polls the epoll set.
+ * The callbacks are the same with every engine.
+ * Must be called before server_listen().
+ * @param server pointer to the server.
+ * @param engine SERVER_ENGINE_LIBEV, SERVER_ENGINE_URING or
+ * SERVER_ENGINE_EPOLL.
+ * @return 0 on success, EINVAL for an unknown engine, ENOSYS if the library
+ * was built without io_uring support.
+ */
+int server_set_engine(struct server *server, server_engine_t engine);
+
+/** Set the number of event loops.
+ * Each loop runs in its own thread, accepts connections on its own listener
+ * and serves them until they are closed. Must be called before
+ * server_listen(). The default is a single loop.
+ * @param server pointer to the server.
+ * @param nr_loops number of loops, 0 for one per online CPU.
+ * @return 0 on success, EINVAL if nr_loops is above SERVER_LOOPS_MAX.
+ */
+int server_set_loops(struct server *server, uint32_t nr_loops);
+
+/** Accept connections in a dedicated thread.
+ * Instead of letting the kernel spread connections over the loops listeners,
+ * an acceptor thread accepts them all and hands each one to the loop chosen
+ * by `balance`, which keeps the loops even when connections are long-lived.
+ * Must be called before server_listen().
+ * @param server pointer to the server.
+ * @param balance one of the server_balance_*() policies or a custom one.
+ * NULL goes back to one listener per loop.
+ * @return 0.
+ */
+int server_set_balancer(struct server *server, server_balance_t balance);
+
+/** Each loop in turn. */
+struct server_loop *server_balance_round_robin(struct server *server);
+
+/** Loop with the fewest connections. */
+struct server_loop *server_balance_least_conn(struct server *server);
+
+/** Less loaded of two loops picked at random. */
+struct server_loop *server_balance_power_of_two(struct server *server);
+
+/** Number of connections served by a loop, including the connections it was
+ * handed and did not pick up yet. Safe to call from any thread.
+ */
+uint32_t server_loop_load(struct server_loop *sloop);
+
 /** Listen of the file descriptor.
- * Start the main event loop and listen for incoming connections on the file
- * descriptor.
+ * Start the event loops and listen for incoming connections on the file
+ * descriptor. Block until server_stop() is called, then close every
+ * connection and call `callbacks->stop`.
  * @param server pointer to the server that will listen.
  * @param host address to listen on.
  * @param port service to listen on.
  * @param backlog maximum number of requests to queue in socket backlog.
- * @return 0 on success, errno value on error.
+ * @return errno value on error, the value given to server_stop() otherwise.
  */
 int server_listen(struct server *server, const void *conf);
 
-/** Stop a server and clean internal structures.
+/** Ask every loop of a server to stop.
+ * Safe to call from any thread, from a callback and from a signal handler.
+ * server_listen() returns once all the loops have stopped; the server must
+ * then be freed with server_free().
  * @param server pointer to the server to stop.
- * @param err error code to return at exit.
+ * @param err value returned by server_listen().
+ * @return 0.
  */
 int server_stop(struct server *server, int err);
 
+/** Finish the current request later.
+ * Only valid inside `do_request` or `do_frame`, which must then return
+ * EINPROGRESS without writing to `bufwrite`. Whatever the handler needs from
+ * `bufread` must be copied: the handler still consumes it before returning.
+ * Other requests of the connection keep being processed; their responses are
+ * held back until this one completed.
+ * Every deferred request must be completed, server_listen() waits for them
+ * before returning.
+ * @return a request to pass to server_request_complete(), NULL on error
+ * (errno is set to EINVAL outside a handler, ENOTSUP with do_request_chain).
+ */
+struct server_request *server_request_defer(void);
+
+/** Buffer receiving the response of a deferred request.
+ * Safe to call from any thread until server_request_complete().
+ * @return the response buffer, NULL on error (errno is set).
+ */
+struct simple_buffer *server_request_buffer(struct server_request *req);
+
+/** Hand the response of a deferred request back to its loop.
+ * Safe to call from any thread. `req` must not be used afterwards.
+ * @param err 0 to send the response, otherwise the connection is closed once
+ * the responses of the earlier requests were queued.
+ */
+void server_request_complete(struct server_request *req, int err);
+
+/** Format the address of a connection's peer, as "ip:port" ("[ip]:port" for
+ * IPv6). Unix socket peers are usually unnamed and give "unix".
+ * @param buf buffer of at least SERVER_ADDRSTRLEN bytes.
+ * @return `buf`.
+ */
+const char *peer_client_addr(const struct peer_client *client,
+		char *buf, size_t len);
+
+/** Identifier of a connection, for server_send().
+ * Typically recorded from `callbacks->accept`.
+ */
+server_conn_t server_client_id(const struct peer_client *client);
+
+/** Queue bytes to send to a connection, from any thread.
+ * The data is copied and handed to the loop of the connection, which appends
+ * everything queued for it since its last iteration, after a single wakeup.
+ * Bytes queued from a given thread are sent in order. They are never
+ * inserted in the middle of a response, but their order relative to the
+ * responses is unspecified.
+ * Must not be called once server_listen() returned.
+ * @param id identifier returned by server_client_id().
+ * @return 0 on success, ESHUTDOWN if the server is not running, EINVAL if
+ * `id` does not designate a loop, ENOMEM. Bytes for a connection closed in
+ * the meantime are silently dropped.
+ */
+int server_send(struct server *server, server_conn_t id,
+		const char *data, size_t len);
+
+/** Loop running the calling thread.
+ * @return the loop whose callback is running, NULL outside of a loop.
+ */
+struct server_loop *server_current_loop(void);
+
+/** I/O engine a loop actually runs, see server_set_engine().
+ * @param sloop loop of the server, set up once the postlisten callback runs.
+ * @return the engine of server_set_engine(), SERVER_ENGINE_LIBEV for a loop
+ * that fell back to libev.
+ */
+server_engine_t server_loop_engine(const struct server_loop *sloop);
+
 
 #endif
 
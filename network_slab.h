@@ -0,0 +1,205 @@
+/*
+ * This file is part of libsimplenet.
+ *
+ * Copyright (C) 2010 Greg Leclercq <ggl@0x80.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 or version 3.0 only.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef _NETWORK_SLAB_
+#define _NETWORK_SLAB_ 1
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "network_list.h"
+
+/* Size of a slab. Slabs are aligned on their size so that the slab of an
+ * object is found by masking the address of the object.
+ */
+#define SLAB_SIZE	(64*1024)
+
+/* Objects start on a cache line. */
+#define SLAB_ALIGN	64
+
+#define SLAB_ROUNDUP(size) (((size) + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1))
+
+/*
+ * Cache of fixed-size objects carved out of slabs, for a single thread.
+ *
+ *  slab: |header|obj|obj|obj|...|obj|   ...never used...   |
+ *                                    ^ nr_carved
+ *
+ * A slab hands out the objects on its free list first, then carves the next
+ * never used object, so the pages of a fresh slab are only touched as it
+ * fills up. A free object holds the free list link in its first bytes.
+ * Slabs with a free object are kept in `partial`, the others in `full`.
+ * An empty slab is given back to the system once at least a whole slab plus
+ * `min_free` objects are free without it, so that a connection coming and
+ * going at a slab boundary does not allocate a slab every time.
+ */
+struct slab {
+	struct list_head list;
+	void	*free;
+	uint32_t nr_used;
+	uint32_t nr_carved;
+};
+
+struct slab_cache {
+	struct list_head partial;
+	struct list_head full;
+	uint32_t object_size;
+	uint32_t nr_objects; /* per slab */
+	uint32_t nr_slabs;
+	uint32_t nr_free;
+	uint32_t min_free;
+};
+
+
+static inline
+void *
+slab_object(struct slab_cache *cache, struct slab *slab, uint32_t i)
+{
+	return (char *) slab + SLAB_ROUNDUP(sizeof(*slab)) +
+		(size_t) i * cache->object_size;
+}
+
+/** Initialize a cache of objects of `size` bytes.
+ * @param min_free number of free objects kept when slabs empty.
+ * @return 0 on success, EINVAL if an object does not fit in a slab.
+ */
+static inline
+int
+slab_cache_init(struct slab_cache *cache, size_t size, uint32_t min_free)
+{
+	INIT_LIST_HEAD(&cache->partial);
+	INIT_LIST_HEAD(&cache->full);
+	cache->nr_slabs = 0;
+	cache->nr_free = 0;
+	if (size < sizeof(void *))
+		size = sizeof(void *);
+	size = SLAB_ROUNDUP(size);
+	if (size > SLAB_SIZE - SLAB_ROUNDUP(sizeof(struct slab)))
+		return EINVAL;
+	cache->object_size = size;
+	cache->nr_objects = (SLAB_SIZE - SLAB_ROUNDUP(sizeof(struct slab))) /
+		size;
+	cache->min_free = min_free;
+	return 0;
+}
+
+/** Free every slab. Objects still allocated are lost. */
+static inline
+void
+slab_cache_destroy(struct slab_cache *cache)
+{
+	struct list_head *pos, *cur;
+	list_for_each_safe(pos, cur, &cache->partial)
+		free(list_entry(pos, struct slab, list));
+	list_for_each_safe(pos, cur, &cache->full)
+		free(list_entry(pos, struct slab, list));
+	INIT_LIST_HEAD(&cache->partial);
+	INIT_LIST_HEAD(&cache->full);
+	cache->nr_slabs = 0;
+	cache->nr_free = 0;
+}
+
+/** Allocate a slab, added at the end of the partial slabs.
+ * @return 0 on success, errno value on error.
+ */
+static inline
+int
+slab_cache_grow(struct slab_cache *cache)
+{
+	struct slab *slab;
+	int err = posix_memalign((void **) &slab, SLAB_SIZE, SLAB_SIZE);
+	if (err) return err;
+	slab->free = NULL;
+	slab->nr_used = 0;
+	slab->nr_carved = 0;
+	list_add_tail(&slab->list, &cache->partial);
+	cache->nr_slabs++;
+	cache->nr_free += cache->nr_objects;
+	return 0;
+}
+
+/** Make sure that the next `nr` allocations need no new slab.
+ * @return 0 on success, errno value on error.
+ */
+static inline
+int
+slab_cache_reserve(struct slab_cache *cache, uint32_t nr)
+{
+	int err = 0;
+	while (cache->nr_free < nr && err == 0)
+		err = slab_cache_grow(cache);
+	return err;
+}
+
+/** Allocate an object.
+ * @return pointer to the object, NULL if an error happened (errno is set).
+ */
+static inline
+void *
+slab_alloc(struct slab_cache *cache)
+{
+	struct slab *slab;
+	void *object;
+	if (list_empty(&cache->partial)) {
+		int err = slab_cache_grow(cache);
+		if (err) {
+			errno = err;
+			return NULL;
+		}
+	}
+	slab = list_first_entry(&cache->partial, struct slab, list);
+	if (slab->free) {
+		object = slab->free;
+		slab->free = *(void **) object;
+	} else {
+		object = slab_object(cache, slab, slab->nr_carved++);
+	}
+	cache->nr_free--;
+	if (++slab->nr_used == cache->nr_objects) {
+		list_del(&slab->list);
+		list_add(&slab->list, &cache->full);
+	}
+	return object;
+}
+
+/** Give an object back to its slab. */
+static inline
+void
+slab_free(struct slab_cache *cache, void *object)
+{
+	struct slab *slab = (struct slab *)
+		((uintptr_t) object & ~(uintptr_t) (SLAB_SIZE - 1));
+	*(void **) object = slab->free;
+	slab->free = object;
+	cache->nr_free++;
+	if (slab->nr_used-- == cache->nr_objects) {
+		list_del(&slab->list);
+		list_add(&slab->list, &cache->partial);
+	} else if (slab->nr_used == 0 &&
+			cache->nr_free >= 2 * cache->nr_objects +
+			cache->min_free) {
+		list_del(&slab->list);
+		free(slab);
+		cache->nr_slabs--;
+		cache->nr_free -= cache->nr_objects;
+	}
+}
+
+
+#endif
+
+/* vim: ts=8:sw=8:noet
+*/
@@ -94,6 +94,29 @@ socket_set_tcpnodelay(int fd)
 
 
 
+int
+socket_set_rcvlowat(int fd, int lowat)
+{
+	int err = setsockopt(fd, SOL_SOCKET, SO_RCVLOWAT,
+			&lowat, sizeof(lowat));
+	if (err == -1) return errno;
+	return 0;
+}
+
+
+
+int
+socket_set_reuseport(int fd)
+{
+	int optval = 1;
+	int err = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT,
+			&optval, sizeof(optval));
+	if (err == -1) return errno;
+	return 0;
+}
+
+
+
 /* Server API */
 int
 socket_listen_unix(int fd, struct sockaddr_un *addr,
@@ -129,6 +152,18 @@ socket_listen_tcp(int fd, struct sockaddr_in *addr,
 }
 
 
+int
+socket_listen_addr(int fd, const struct sockaddr *addr,
+		socklen_t addrlen, int backlog)
+{
+	int err = bind(fd, addr, addrlen);
+	if (err == -1) return errno;
+	err = listen(fd, backlog);
+	if (err == -1) return errno;
+	return 0;
+}
+
+
 
 /* client API */
 inline
@@ -46,11 +46,15 @@ int socket_close(int fd);
 
 int socket_set_nonblocking(int fd);
 int socket_set_tcpnodelay(int fd);
+int socket_set_rcvlowat(int fd, int lowat);
+int socket_set_reuseport(int fd);
 
 int socket_listen_unix(int fd, struct sockaddr_un *addr,
 		const char *path, int backlog);
 int socket_listen_tcp(int fd, struct sockaddr_in *addr,
 		const char *host, int port, int backlog);
+int socket_listen_addr(int fd, const struct sockaddr *addr,
+		socklen_t addrlen, int backlog);
 
 int socket_connect_unix(const int fd, const char *path);
 int socket_connect_tcp(const int fd, const char *ip, const int port);
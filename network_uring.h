@@ -0,0 +1,437 @@
+/*
+ * This file is part of libsimplenet.
+ *
+ * Copyright (C) 2010 Greg Leclercq <ggl@0x80.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 or version 3.0 only.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef _NETWORK_URING_
+#define _NETWORK_URING_ 1
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/*
+ * Minimal io_uring ring, on top of the raw system calls, for a single
+ * thread.
+ *
+ * SQEs are taken with uring_get_sqe(), filled, and go to the kernel with the
+ * next uring_submit(). Completions are read in place:
+ *
+ *	while ((cqe = uring_peek_cqe(ring)) != NULL) {
+ *		...
+ *		uring_cqe_seen(ring);
+ *	}
+ *
+ * The kernel headers of Linux 6.0 are needed for multishot recv; with older
+ * ones, uring_init() fails with ENOSYS.
+ */
+#ifdef IORING_RECV_MULTISHOT
+#define URING_SUPPORTED	1
+#endif
+
+struct uring {
+	int	fd;
+	uint32_t *sq_head;
+	uint32_t *sq_tail;
+	uint32_t sq_mask;
+	uint32_t sq_entries;
+	uint32_t sq_local; /* tail of the SQEs not submitted yet */
+	uint32_t *cq_head;
+	uint32_t *cq_tail;
+	uint32_t cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void	*ring;
+	size_t	ring_size;
+	size_t	sqes_size;
+};
+
+/*
+ * Ring of provided buffers: the kernel picks one per received chunk and
+ * tells its id in the completion, which gives it back with uring_buf_put().
+ */
+struct uring_buf_ring {
+	struct io_uring_buf_ring *br;
+	char	*mem;
+	uint32_t nr_bufs;
+	uint32_t buf_size;
+	uint16_t bgid;
+	uint16_t tail;
+};
+
+#ifdef URING_SUPPORTED
+
+static inline
+int
+uring_setup(uint32_t entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline
+int
+uring_enter(int fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+			NULL, 0);
+}
+
+/** @return 0 on success, -1 on error (errno is set). */
+static inline
+int
+uring_register(struct uring *ring, uint32_t opcode, const void *arg,
+		uint32_t nr_args)
+{
+	return syscall(__NR_io_uring_register, ring->fd, opcode, arg, nr_args)
+		< 0 ? -1 : 0;
+}
+
+/** Create a ring of `entries` SQEs and `cq_entries` CQEs.
+ * @return 0 on success, errno value on error.
+ */
+static inline
+int
+uring_init(struct uring *ring, uint32_t entries, uint32_t cq_entries)
+{
+	struct io_uring_params p;
+	memset(ring, 0, sizeof(*ring));
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+	p.cq_entries = cq_entries;
+	ring->fd = uring_setup(entries, &p);
+	if (ring->fd < 0)
+		return errno;
+	/* the SQ and CQ rings share a single mapping */
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+			!(p.features & IORING_FEAT_NODROP)) {
+		close(ring->fd);
+		return ENOSYS;
+	}
+	ring->ring_size = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+	if (ring->ring_size < p.cq_off.cqes +
+			p.cq_entries * sizeof(struct io_uring_cqe))
+		ring->ring_size = p.cq_off.cqes +
+			p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->ring = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->ring == MAP_FAILED) {
+		int err = errno;
+		close(ring->fd);
+		return err;
+	}
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		int err = errno;
+		munmap(ring->ring, ring->ring_size);
+		close(ring->fd);
+		return err;
+	}
+	char *base = ring->ring;
+	ring->sq_head = (uint32_t *) (base + p.sq_off.head);
+	ring->sq_tail = (uint32_t *) (base + p.sq_off.tail);
+	ring->sq_mask = *(uint32_t *) (base + p.sq_off.ring_mask);
+	ring->sq_entries = p.sq_entries;
+	ring->sq_local = *ring->sq_tail;
+	ring->cq_head = (uint32_t *) (base + p.cq_off.head);
+	ring->cq_tail = (uint32_t *) (base + p.cq_off.tail);
+	ring->cq_mask = *(uint32_t *) (base + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) (base + p.cq_off.cqes);
+	/* SQEs are used in ring order */
+	uint32_t *array = (uint32_t *) (base + p.sq_off.array), i;
+	for (i = 0; i < p.sq_entries; i++)
+		array[i] = i;
+	return 0;
+}
+
+/** Close the ring. The kernel cancels the requests still in progress. */
+static inline
+void
+uring_destroy(struct uring *ring)
+{
+	munmap(ring->sqes, ring->sqes_size);
+	munmap(ring->ring, ring->ring_size);
+	close(ring->fd);
+	ring->fd = -1;
+}
+
+/** @return 1 if the kernel knows the `opcode` operation, 0 otherwise. */
+static inline
+int
+uring_probe(struct uring *ring, uint8_t opcode)
+{
+	struct {
+		struct io_uring_probe probe;
+		struct io_uring_probe_op ops[256];
+	} p;
+	memset(&p, 0, sizeof(p));
+	if (uring_register(ring, IORING_REGISTER_PROBE, &p, 256))
+		return 0;
+	return opcode <= p.probe.last_op &&
+		(p.ops[opcode].flags & IO_URING_OP_SUPPORTED);
+}
+
+/** @return number of SQEs waiting for uring_submit(). */
+static inline
+uint32_t
+uring_sq_pending(const struct uring *ring)
+{
+	return ring->sq_local - *ring->sq_tail;
+}
+
+/** @return a zeroed SQE, NULL if the SQ ring is full. */
+static inline
+struct io_uring_sqe *
+uring_get_sqe(struct uring *ring)
+{
+	uint32_t head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if (ring->sq_local - head >= ring->sq_entries)
+		return NULL;
+	struct io_uring_sqe *sqe = &ring->sqes[ring->sq_local++ & ring->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+/** Hand the new SQEs to the kernel and wait for `wait_nr` completions.
+ * @return 0 on success, errno value on error.
+ */
+static inline
+int
+uring_submit(struct uring *ring, uint32_t wait_nr)
+{
+	uint32_t nr = uring_sq_pending(ring);
+	__atomic_store_n(ring->sq_tail, ring->sq_local, __ATOMIC_RELEASE);
+	if (nr == 0 && wait_nr == 0)
+		return 0;
+	if (uring_enter(ring->fd, nr, wait_nr,
+				wait_nr ? IORING_ENTER_GETEVENTS : 0) < 0)
+		return errno;
+	return 0;
+}
+
+/** @return the next completion, NULL if there is none. */
+static inline
+struct io_uring_cqe *
+uring_peek_cqe(struct uring *ring)
+{
+	uint32_t head = *ring->cq_head;
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &ring->cqes[head & ring->cq_mask];
+}
+
+/** Give the completion returned by uring_peek_cqe() back to the kernel. */
+static inline
+void
+uring_cqe_seen(struct uring *ring)
+{
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+static inline
+void
+uring_sqe_set_data(struct io_uring_sqe *sqe, uint64_t data)
+{
+	sqe->user_data = data;
+}
+
+/** Accept connections until cancelled, non-blocking and close-on-exec. */
+static inline
+void
+uring_prep_accept_multishot(struct io_uring_sqe *sqe, int fd)
+{
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+}
+
+/** Receive into buffers of group `bgid` until cancelled or end of stream.
+ * @param fixed 1 if `fd` is an index in the registered files.
+ */
+static inline
+void
+uring_prep_recv_multishot(struct io_uring_sqe *sqe, int fd, int fixed,
+		uint16_t bgid)
+{
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->flags = IOSQE_BUFFER_SELECT | (fixed ? IOSQE_FIXED_FILE : 0);
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->buf_group = bgid;
+}
+
+static inline
+void
+uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd, int fixed,
+		const struct msghdr *msg, uint32_t flags)
+{
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = fd;
+	sqe->flags = fixed ? IOSQE_FIXED_FILE : 0;
+	sqe->addr = (uintptr_t) msg;
+	sqe->len = 1;
+	sqe->msg_flags = flags;
+}
+
+/** One-shot poll for `events`. */
+static inline
+void
+uring_prep_poll(struct io_uring_sqe *sqe, int fd, int fixed, uint32_t events)
+{
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->flags = fixed ? IOSQE_FIXED_FILE : 0;
+	sqe->poll32_events = events;
+}
+
+/** Cancel the request submitted with `data`. */
+static inline
+void
+uring_prep_cancel(struct io_uring_sqe *sqe, uint64_t data)
+{
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = data;
+}
+
+/** Register a table of `nr` empty file slots.
+ * @return 0 on success, errno value on error.
+ */
+static inline
+int
+uring_register_files_sparse(struct uring *ring, uint32_t nr)
+{
+	struct io_uring_rsrc_register reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.nr = nr;
+	reg.flags = IORING_RSRC_REGISTER_SPARSE;
+	return uring_register(ring, IORING_REGISTER_FILES2, &reg, sizeof(reg))
+		? errno : 0;
+}
+
+/** Put `fd` in the slot `slot` of the registered files, -1 to empty it.
+ * @return 0 on success, errno value on error.
+ */
+static inline
+int
+uring_register_file(struct uring *ring, uint32_t slot, int fd)
+{
+	struct io_uring_files_update up = {
+		.offset = slot,
+		.fds = (uintptr_t) &fd
+	};
+	return uring_register(ring, IORING_REGISTER_FILES_UPDATE, &up, 1)
+		? errno : 0;
+}
+
+/** Give buffer `bid` back to the kernel. Published by uring_buf_commit(). */
+static inline
+void
+uring_buf_put(struct uring_buf_ring *bufs, uint16_t bid)
+{
+	struct io_uring_buf *buf =
+		&bufs->br->bufs[bufs->tail++ & (bufs->nr_bufs - 1)];
+	buf->addr = (uintptr_t) (bufs->mem + (size_t) bid * bufs->buf_size);
+	buf->len = bufs->buf_size;
+	buf->bid = bid;
+}
+
+static inline
+void
+uring_buf_commit(struct uring_buf_ring *bufs)
+{
+	__atomic_store_n(&bufs->br->tail, bufs->tail, __ATOMIC_RELEASE);
+}
+
+static inline
+char *
+uring_buf(const struct uring_buf_ring *bufs, uint16_t bid)
+{
+	return bufs->mem + (size_t) bid * bufs->buf_size;
+}
+
+/** Register `nr_bufs` buffers of `buf_size` bytes as group `bgid`.
+ * @param nr_bufs power of 2, at most 32768.
+ * @return 0 on success, errno value on error.
+ */
+static inline
+int
+uring_buf_ring_init(struct uring *ring, struct uring_buf_ring *bufs,
+		uint32_t nr_bufs, uint32_t buf_size, uint16_t bgid)
+{
+	size_t ring_size = nr_bufs * sizeof(struct io_uring_buf);
+	struct io_uring_buf_reg reg;
+	uint32_t i;
+	int err;
+	memset(bufs, 0, sizeof(*bufs));
+	err = posix_memalign((void **) &bufs->br, getpagesize(), ring_size);
+	if (err) return err;
+	bufs->mem = malloc((size_t) nr_bufs * buf_size);
+	if (bufs->mem == NULL) {
+		free(bufs->br);
+		return ENOMEM;
+	}
+	bufs->nr_bufs = nr_bufs;
+	bufs->buf_size = buf_size;
+	bufs->bgid = bgid;
+	memset(bufs->br, 0, ring_size);
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t) bufs->br;
+	reg.ring_entries = nr_bufs;
+	reg.bgid = bgid;
+	if (uring_register(ring, IORING_REGISTER_PBUF_RING, &reg, 1)) {
+		err = errno;
+		free(bufs->mem);
+		free(bufs->br);
+		return err;
+	}
+	for (i = 0; i < nr_bufs; i++)
+		uring_buf_put(bufs, i);
+	uring_buf_commit(bufs);
+	return 0;
+}
+
+/** Free the buffers, once the ring is closed. */
+static inline
+void
+uring_buf_ring_destroy(struct uring_buf_ring *bufs)
+{
+	free(bufs->mem);
+	free(bufs->br);
+	bufs->mem = NULL;
+	bufs->br = NULL;
+}
+
+#else /* !URING_SUPPORTED */
+
+static inline
+int
+uring_init(struct uring *ring, uint32_t entries, uint32_t cq_entries)
+{
+	return ENOSYS;
+}
+
+#endif
+
+#endif
+
+/* vim: ts=8:sw=8:noet
+*/
@@ -0,0 +1,184 @@
+/*
+ * This file is part of libsimplenet.
+ *
+ * Copyright (C) 2010 Greg Leclercq <ggl@0x80.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 or version 3.0 only.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef _NETWORK_WHEEL_
+#define _NETWORK_WHEEL_ 1
+
+#include <stdint.h>
+
+#include "network_list.h"
+
+#define WHEEL_BITS	6
+#define WHEEL_SLOTS	(1 << WHEEL_BITS)
+#define WHEEL_MASK	(WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS	4
+
+/* Longest delay, in ticks. Longer ones are shortened. */
+#define WHEEL_MAX_DELAY	((1U << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+/*
+ * Hierarchical timing wheel, for a single thread.
+ *
+ * Time is counted in ticks. A timer goes to the lowest level whose slots
+ * still tell its tick apart from the current one: level 0 holds the timers
+ * of the current 64 ticks, one slot per tick, level 1 those of the current
+ * 4096 ticks, one slot per 64 ticks, and so on. When the current tick enters
+ * a new slot of level n > 0, the timers of that slot are spread over the
+ * lower levels. Adding, moving and removing a timer are O(1); each timer is
+ * moved at most once per level before it expires.
+ * The tick counter wraps around after 2^32 ticks.
+ */
+struct wheel_timer {
+	struct list_head list;
+	uint32_t expires;
+};
+
+struct timing_wheel {
+	uint32_t now;
+	uint32_t nr_timers;
+	struct list_head slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+
+static inline
+void
+wheel_init(struct timing_wheel *wheel, uint32_t now)
+{
+	int level, slot;
+	wheel->now = now;
+	wheel->nr_timers = 0;
+	for (level = 0; level < WHEEL_LEVELS; level++)
+		for (slot = 0; slot < WHEEL_SLOTS; slot++)
+			INIT_LIST_HEAD(&wheel->slots[level][slot]);
+}
+
+static inline
+void
+wheel_timer_init(struct wheel_timer *timer)
+{
+	INIT_LIST_HEAD(&timer->list);
+}
+
+/** @return 1 if the timer is in the wheel, 0 otherwise. */
+static inline
+int
+wheel_timer_pending(const struct wheel_timer *timer)
+{
+	return !list_empty(&timer->list);
+}
+
+static inline
+void
+wheel_insert(struct timing_wheel *wheel, struct wheel_timer *timer)
+{
+	uint32_t expires = timer->expires;
+	int level;
+	for (level = 0; level < WHEEL_LEVELS - 1; level++) {
+		int shift = WHEEL_BITS * (level + 1);
+		if (expires >> shift == wheel->now >> shift)
+			break;
+	}
+	list_add_tail(&timer->list, &wheel->slots[level][
+			(expires >> (WHEEL_BITS * level)) & WHEEL_MASK]);
+}
+
+/** Remove a timer from the wheel. Does nothing if it is not in the wheel. */
+static inline
+void
+wheel_del(struct timing_wheel *wheel, struct wheel_timer *timer)
+{
+	if (!wheel_timer_pending(timer))
+		return ;
+	list_del(&timer->list);
+	INIT_LIST_HEAD(&timer->list);
+	wheel->nr_timers--;
+}
+
+/** Add a timer, or move it if it is already in the wheel.
+ * @param expires tick at which the timer expires. A tick that is not in the
+ * future expires on the next tick.
+ */
+static inline
+void
+wheel_add(struct timing_wheel *wheel, struct wheel_timer *timer,
+		uint32_t expires)
+{
+	uint32_t delay = expires - wheel->now;
+	if (delay == 0 || delay > WHEEL_MAX_DELAY)
+		expires = wheel->now + ((int32_t) delay > 0 ?
+				WHEEL_MAX_DELAY : 1);
+	wheel_del(wheel, timer);
+	timer->expires = expires;
+	wheel_insert(wheel, timer);
+	wheel->nr_timers++;
+}
+
+static inline
+void
+wheel_cascade(struct timing_wheel *wheel, struct list_head *slot)
+{
+	struct list_head *pos, *cur;
+	LIST_HEAD(timers);
+	if (list_empty(slot))
+		return ;
+	/* take the whole slot first: timers may go back to the same list */
+	timers.next = slot->next;
+	timers.prev = slot->prev;
+	timers.next->prev = &timers;
+	timers.prev->next = &timers;
+	INIT_LIST_HEAD(slot);
+	list_for_each_safe(pos, cur, &timers)
+		wheel_insert(wheel, list_entry(pos, struct wheel_timer, list));
+}
+
+/** Move the clock forward to `now`.
+ * The timers that expire on the way are moved to `expired`, in expiry
+ * order. They are no longer in the wheel, but their `list` links them in
+ * `expired`: wheel_timer_init() them once they are taken off it.
+ */
+static inline
+void
+wheel_advance(struct timing_wheel *wheel, uint32_t now,
+		struct list_head *expired)
+{
+	while ((int32_t) (now - wheel->now) > 0) {
+		if (wheel->nr_timers == 0) {
+			wheel->now = now;
+			break;
+		}
+		uint32_t tick = ++wheel->now;
+		int level;
+		for (level = 1; level < WHEEL_LEVELS; level++) {
+			int shift = WHEEL_BITS * level;
+			if (tick & ((1U << shift) - 1))
+				break;
+			wheel_cascade(wheel, &wheel->slots[level][
+					(tick >> shift) & WHEEL_MASK]);
+		}
+		struct list_head *slot = &wheel->slots[0][tick & WHEEL_MASK];
+		while (!list_empty(slot)) {
+			struct list_head *pos = slot->next;
+			list_del(pos);
+			list_add_tail(pos, expired);
+			wheel->nr_timers--;
+		}
+	}
+}
+
+
+#endif
+
+/* vim: ts=8:sw=8:noet
+*/